@@ -22,15 +22,112 @@
 #define __EASOUNDLIB_H__
 
 #include <tinyalsa/asoundlib.h>
+#include <stdint.h>
 
 #if defined(__cplusplus)
 extern "C" {
 #endif
 
+/* Client sample formats, converted from/to pcm_config.format */
+enum epcm_format {
+	EPCM_FORMAT_DEVICE = 0,		/* pcm_config.format as is */
+	EPCM_FORMAT_S16_LE,
+	EPCM_FORMAT_S24_LE,		/* 24 bits in the low bytes of 32 */
+	EPCM_FORMAT_S24_3LE,
+	EPCM_FORMAT_S32_LE,
+	EPCM_FORMAT_FLOAT_LE,		/* float32 in [-1.0, 1.0) */
+};
+
+/* Scheduling jitter a negotiated configuration rides out */
+enum epcm_robustness {
+	EPCM_ROBUSTNESS_NORMAL = 0,	/* 3 periods of at least 2 ms */
+	EPCM_ROBUSTNESS_LOW,		/* 2 periods of at least 1 ms */
+	EPCM_ROBUSTNESS_HIGH,		/* 4 periods of at least 5 ms, extended buffer */
+};
+
+/* A timer paced device standing in for card/device, to run the whole
+ * streaming path without audio hardware. It takes the rate and geometry
+ * of pcm_config, runs drift_ppm fast or slow, wakes up to jitter_usecs
+ * late each period and stops for stall_millisecs every
+ * stall_every_millisecs.
+ */
+struct epcm_virtual {
+	int drift_ppm;
+	unsigned int jitter_usecs;
+	unsigned int stall_every_millisecs;
+	unsigned int stall_millisecs;
+
+	/* Fills captured frames or takes the played ones, in the device
+	 * format. Without it, capture gives silence and playback drops.
+	 */
+	void (*xfer)(void *arg, void *frames, unsigned int count);
+	void *arg;
+};
+
 struct epcm;
 struct epcm_config {
 	unsigned int ram_millisecs;
 	int tuner;
+
+	/* The tuner is a PI controller which resamples by a few ppm to hold
+	 * the extended buffer at a target fill level. Zero selects defaults.
+	 */
+	unsigned int tuner_target_millisecs;	/* default: ram_millisecs / 2 */
+	unsigned int tuner_max_ppm;		/* default: 2000 */
+	float tuner_kp;				/* ppm per ms of error, default: 50 */
+	float tuner_ki;				/* ppm per ms of error per second, default: 0.6 */
+
+	/* Keep the extended buffer in float32, converting the samples once
+	 * on the way in and once on the way out.
+	 */
+	int float_path;
+
+	/* Client side channel layout, mapped or mixed from/to the device
+	 * channels while pcm_streaming_thread copies through the extended
+	 * buffer. chmap[out] is the input channel feeding each output
+	 * channel, or -1 for silence, and chmatrix holds [out][in] gains;
+	 * "out" is the client side on capture and the device on playback.
+	 * Without either, the first channels are kept. Needs ram_millisecs.
+	 */
+	unsigned int channels;			/* default: device channels */
+	const int *chmap;
+	const float *chmatrix;
+
+	/* Sample format of the data passed to epcm_read()/epcm_write(),
+	 * converted in the same pass. Needs ram_millisecs.
+	 */
+	enum epcm_format format;
+
+	/* Opens a virtual device instead of card/device, epcm_base() is
+	 * NULL then.
+	 */
+	const struct epcm_virtual *virtual_device;
+
+	/* Collect the histograms of epcm_get_histogram(). Needs
+	 * ram_millisecs.
+	 */
+	int histograms;
+
+	/* Keep the last trace_events events of the extended buffer for
+	 * epcm_get_trace(), rounded up to a power of two. Needs
+	 * ram_millisecs.
+	 */
+	unsigned int trace_events;
+
+	/* With epcm_open_callback(), playback renders one period ahead of
+	 * the device, which absorbs a late callback.
+	 */
+	int callback_ahead;
+
+	/* Picks period_size, period_count and ram_millisecs from the device
+	 * ranges of pcm_params_get() instead of taking them as given: the
+	 * smallest configuration safe at robustness, grown towards the
+	 * target. 1 asks for the lowest latency the device supports. A non
+	 * zero ram_millisecs still asks for the extended buffer.
+	 * epcm_get_config() reports the choice.
+	 */
+	unsigned int target_latency_millisecs;
+	enum epcm_robustness robustness;
 };
 
 struct epcm *epcm_open(unsigned int card,
@@ -39,14 +136,131 @@ struct epcm *epcm_open(unsigned int card,
                        const struct pcm_config *config,
                        const struct epcm_config *econfig);
 
+/* Same as epcm_open(), with the stream driven by pcm_streaming_thread
+ * which calls callback for each block of frames: to fill for playback,
+ * or captured ones. frames points into the extended buffer, in the
+ * client layout. epcm_read()/epcm_write(), their planar variants and
+ * epcm_drain() fail then, as the callback renders until epcm_close().
+ * The tuner is off. Needs ram_millisecs.
+ */
+struct epcm *epcm_open_callback(unsigned int card,
+                                unsigned int device,
+                                unsigned int flags,
+                                const struct pcm_config *config,
+                                const struct epcm_config *econfig,
+                                void (*callback)(void *arg, void *frames,
+                                                 unsigned int count),
+                                void *arg);
+
 struct pcm *epcm_base(struct epcm *epcm);
 
+/* Reports the device configuration in use and the extended buffer size,
+ * 0 in bypass mode. Either pointer may be NULL.
+ */
+int epcm_get_config(struct epcm *epcm, struct pcm_config *config,
+                    unsigned int *ram_millisecs);
+
 int epcm_read(struct epcm *epcm, void *data, unsigned int count);
 
 int epcm_write(struct epcm *epcm, const void *data, unsigned int count);
 
+/* Same as epcm_read()/epcm_write() with one buffer per client channel
+ * instead of interleaved frames, and a count in frames. With the extended
+ * buffer and no tuner, the channels are transposed in the ring copy.
+ */
+int epcm_readn(struct epcm *epcm, void **data, unsigned int frames);
+
+int epcm_writen(struct epcm *epcm, void **data, unsigned int frames);
+
 int epcm_drain(struct epcm *epcm);
 
+/* Sets one gain per client channel, reached by a linear ramp over
+ * ramp_frames frames (0 jumps). It is applied as the frames pass between
+ * the device and the extended buffer, so it takes effect at the next
+ * hardware transfer. Needs ram_millisecs.
+ */
+int epcm_set_gain(struct epcm *epcm, const float *gain, unsigned int channels,
+                  unsigned int ramp_frames);
+
+/* What pcm_streaming_thread does on each iteration */
+enum epcm_histogram_id {
+	EPCM_HIST_WAKEUP = 0,	/* usecs from the start of the previous iteration */
+	EPCM_HIST_DEVICE,	/* usecs blocked in pcm_read()/pcm_write() */
+	EPCM_HIST_QUEUE,	/* usecs copying through the extended buffer, lock included */
+	EPCM_HIST_LEVEL,	/* frames in the extended buffer after the previous transfer */
+	EPCM_HIST_COUNT
+};
+
+/* bins[0] counts zeros, bins[i] values in [2^(i-1), 2^i) and the last
+ * bin everything above.
+ */
+#define EPCM_HISTOGRAM_BINS 24
+struct epcm_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bins[EPCM_HISTOGRAM_BINS];
+};
+
+/* Copies one histogram without taking any lock, it can be polled while
+ * streaming. Needs epcm_config.histograms.
+ */
+int epcm_get_histogram(struct epcm *epcm, enum epcm_histogram_id id,
+                       struct epcm_histogram *hist);
+
+/* Ratio steps of epcm_stats.tuner_frames, evenly spread over
+ * [-tuner_max_ppm, tuner_max_ppm].
+ */
+#define EPCM_TUNER_STEPS 8
+
+struct epcm_stats {
+	uint64_t overruns;
+	uint64_t underruns;
+	uint64_t lost_frames;		/* overwritten on overrun, skipped on underrun */
+	uint64_t device_frames;		/* through pcm_streaming_thread */
+	uint64_t client_frames;		/* through epcm_read()/epcm_write() */
+
+	/* extended buffer frames after each hardware transfer */
+	unsigned int level_min;
+	unsigned int level_max;
+	double level_avg;
+
+	double tuner_ppm;
+	uint64_t tuner_frames[EPCM_TUNER_STEPS];	/* client frames */
+
+	uint64_t thread_cpu_usecs;	/* pcm_streaming_thread */
+};
+
+/* Fills a snapshot of the counters since epcm_open(). Each side of the
+ * extended buffer publishes its own counters consistently, and none of
+ * it takes the queue lock. Needs ram_millisecs.
+ */
+int epcm_get_stats(struct epcm *epcm, struct epcm_stats *stats);
+
+enum epcm_trace_id {
+	EPCM_TRACE_HW_WRITE = 0,	/* capture device to extended buffer, value: bytes */
+	EPCM_TRACE_HW_READ,		/* extended buffer to playback device, value: bytes */
+	EPCM_TRACE_APPL_READ,		/* extended buffer to epcm_read(), value: bytes */
+	EPCM_TRACE_APPL_WRITE,		/* epcm_write() to extended buffer, value: bytes */
+	EPCM_TRACE_OVERRUN,		/* value: bytes lost */
+	EPCM_TRACE_UNDERRUN,		/* value: bytes lost */
+	EPCM_TRACE_TUNER,		/* level: filtered, value: ppm */
+};
+
+struct epcm_trace_event {
+	uint64_t nsecs;			/* CLOCK_MONOTONIC */
+	uint32_t id;
+	uint32_t level;			/* extended buffer frames after the event */
+	int64_t value;
+};
+
+/* Copies up to count of the most recent trace events, oldest first,
+ * and returns how many. It does not stop the tracing threads, events
+ * overwritten while copying are left out. Needs epcm_config.trace_events.
+ */
+int epcm_get_trace(struct epcm *epcm, struct epcm_trace_event *events,
+                   unsigned int count);
+
 int epcm_close(struct epcm *epcm);
 
 #if defined(__cplusplus)
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <klogging.h>
+#include "backend.h"
+
+static int pcm_backend_read(struct backend *be, void *data, unsigned int count)
+{
+	return pcm_read(be->pcm, data, count);
+}
+
+static int pcm_backend_write(struct backend *be, const void *data, unsigned int count)
+{
+	return pcm_write(be->pcm, data, count);
+}
+
+static void pcm_backend_close(struct backend *be)
+{
+	pcm_close(be->pcm);
+	be->pcm = NULL;
+}
+
+static const struct backend_ops pcm_backend_ops = {
+	.read = pcm_backend_read,
+	.write = pcm_backend_write,
+	.close = pcm_backend_close,
+};
+
+int backend_open_pcm(struct backend *be, unsigned int card, unsigned int device,
+                     unsigned int flags, const struct pcm_config *config)
+{
+	be->pcm = pcm_open(card, device, flags, config);
+	if (!be->pcm) {
+		KLOGE("Unable to open PCM device");
+		return -1;
+	}
+	be->ops = &pcm_backend_ops;
+	if (!pcm_is_ready(be->pcm)) {
+		KLOGE("Unable to open PCM device (%s)", pcm_get_error(be->pcm));
+		return -1;
+	}
+
+	be->config = *pcm_get_config(be->pcm);
+	be->buffer_size = pcm_get_buffer_size(be->pcm);
+	be->frame_bytes = pcm_frames_to_bytes(be->pcm, 1);
+
+	return 0;
+}
+
+void backend_close(struct backend *be)
+{
+	if (be->ops)
+		be->ops->close(be);
+	be->ops = NULL;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __BACKEND_H__
+#define __BACKEND_H__
+
+#include <stddef.h>
+#include <tinyalsa/asoundlib.h>
+#include <easoundlib.h>
+
+/* The device under an epcm: a tinyalsa pcm, or a timer paced virtual
+ * device. read/write take bytes and block like pcm_read()/pcm_write().
+ */
+struct backend;
+
+struct backend_ops {
+	int (*read)(struct backend *be, void *data, unsigned int count);
+	int (*write)(struct backend *be, const void *data, unsigned int count);
+	void (*close)(struct backend *be);
+};
+
+struct backend {
+	const struct backend_ops *ops;
+	struct pcm *pcm;		/* NULL on a virtual device */
+	struct pcm_config config;	/* as granted by the device */
+	unsigned int buffer_size;	/* in frames */
+	size_t frame_bytes;
+	void *priv;
+};
+
+int backend_open_pcm(struct backend *be, unsigned int card, unsigned int device,
+                     unsigned int flags, const struct pcm_config *config);
+int backend_open_virtual(struct backend *be, unsigned int flags,
+                         const struct pcm_config *config,
+                         const struct epcm_virtual *vdev);
+void backend_close(struct backend *be);
+
+static inline int backend_read(struct backend *be, void *data, unsigned int count)
+{
+	return be->ops->read(be, data, count);
+}
+
+static inline int backend_write(struct backend *be, const void *data, unsigned int count)
+{
+	return be->ops->write(be, data, count);
+}
+
+#endif
@@ -0,0 +1,611 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "convert.h"
+
+/* Frames converted per pass, small enough to keep the float blocks in L1 */
+#define CONVERT_BLOCK_FRAMES 64
+
+#define S16_SCALE 32768.0f
+#define S24_SCALE 8388608.0f
+#define S32_SCALE 2147483648.0f
+/* INT32_MAX is not representable in float, this is the largest below it */
+#define S32_MAX_FLOAT 2147483520.0f
+
+/* Rounds and saturates to [min, max]. Written with selects only, so
+ * that the loops calling it vectorize.
+ */
+static inline int32_t float_to_int(float f, float scale, float min, float max)
+{
+	float x = f * scale;
+
+	x = x < min ? min : x;
+	x = x > max ? max : x;
+	return (int32_t)(x + __builtin_copysignf(0.5f, x));
+}
+
+static void s16_to_float(void *dst, const void *src, size_t samples)
+{
+	float *restrict d = (float *)dst;
+	const int16_t *restrict s = (const int16_t *)src;
+	size_t i;
+
+	for (i = 0; i < samples; ++i)
+		d[i] = s[i] * (1.0f / S16_SCALE);
+}
+
+static void float_to_s16(void *dst, const void *src, size_t samples)
+{
+	int16_t *restrict d = (int16_t *)dst;
+	const float *restrict s = (const float *)src;
+	size_t i;
+
+	for (i = 0; i < samples; ++i)
+		d[i] = float_to_int(s[i], S16_SCALE, -32768.0f, 32767.0f);
+}
+
+/* S24_LE holds 24 bits in the low bytes of a 32-bit word */
+static void s24_to_float(void *dst, const void *src, size_t samples)
+{
+	float *restrict d = (float *)dst;
+	const int32_t *restrict s = (const int32_t *)src;
+	size_t i;
+
+	for (i = 0; i < samples; ++i)
+		d[i] = ((int32_t)((uint32_t)s[i] << 8) >> 8) * (1.0f / S24_SCALE);
+}
+
+static void float_to_s24(void *dst, const void *src, size_t samples)
+{
+	int32_t *restrict d = (int32_t *)dst;
+	const float *restrict s = (const float *)src;
+	size_t i;
+
+	for (i = 0; i < samples; ++i)
+		d[i] = float_to_int(s[i], S24_SCALE, -8388608.0f, 8388607.0f);
+}
+
+/* S24_3LE packs the same 24 bits into three bytes */
+static void s24_3_to_float(void *dst, const void *src, size_t samples)
+{
+	float *restrict d = (float *)dst;
+	const uint8_t *restrict s = (const uint8_t *)src;
+	size_t i;
+
+	for (i = 0; i < samples; ++i) {
+		const uint32_t u = (uint32_t)s[3 * i] << 8 | (uint32_t)s[3 * i + 1] << 16
+		                   | (uint32_t)s[3 * i + 2] << 24;
+		d[i] = ((int32_t)u >> 8) * (1.0f / S24_SCALE);
+	}
+}
+
+static void float_to_s24_3(void *dst, const void *src, size_t samples)
+{
+	uint8_t *restrict d = (uint8_t *)dst;
+	const float *restrict s = (const float *)src;
+	size_t i;
+
+	for (i = 0; i < samples; ++i) {
+		const int32_t v = float_to_int(s[i], S24_SCALE, -8388608.0f, 8388607.0f);
+		d[3 * i] = (uint8_t)v;
+		d[3 * i + 1] = (uint8_t)(v >> 8);
+		d[3 * i + 2] = (uint8_t)(v >> 16);
+	}
+}
+
+static void s32_to_float(void *dst, const void *src, size_t samples)
+{
+	float *restrict d = (float *)dst;
+	const int32_t *restrict s = (const int32_t *)src;
+	size_t i;
+
+	for (i = 0; i < samples; ++i)
+		d[i] = s[i] * (1.0f / S32_SCALE);
+}
+
+static void float_to_s32(void *dst, const void *src, size_t samples)
+{
+	int32_t *restrict d = (int32_t *)dst;
+	const float *restrict s = (const float *)src;
+	size_t i;
+
+	for (i = 0; i < samples; ++i)
+		d[i] = float_to_int(s[i], S32_SCALE, -2147483648.0f, S32_MAX_FLOAT);
+}
+
+convert_func convert_to_float(enum pcm_format format)
+{
+	switch (format) {
+	case PCM_FORMAT_S16_LE:
+		return s16_to_float;
+	case PCM_FORMAT_S24_LE:
+		return s24_to_float;
+	case PCM_FORMAT_S24_3LE:
+		return s24_3_to_float;
+	case PCM_FORMAT_S32_LE:
+		return s32_to_float;
+	default:
+		return NULL;
+	}
+}
+
+convert_func convert_from_float(enum pcm_format format)
+{
+	switch (format) {
+	case PCM_FORMAT_S16_LE:
+		return float_to_s16;
+	case PCM_FORMAT_S24_LE:
+		return float_to_s24;
+	case PCM_FORMAT_S24_3LE:
+		return float_to_s24_3;
+	case PCM_FORMAT_S32_LE:
+		return float_to_s32;
+	default:
+		return NULL;
+	}
+}
+
+int convert_is_supported(enum pcm_format format)
+{
+	return format == CONVERT_FORMAT_FLOAT || convert_to_float(format) != NULL;
+}
+
+size_t convert_sample_bytes(enum pcm_format format)
+{
+	if (format == CONVERT_FORMAT_FLOAT)
+		return sizeof(float);
+	return pcm_format_to_bits(format) / 8;
+}
+
+static int convert_is_identity(const int *map, unsigned int in_channels,
+                               unsigned int out_channels)
+{
+	unsigned int ch;
+
+	if (in_channels != out_channels)
+		return 0;
+	for (ch = 0; ch < out_channels; ++ch) {
+		if (map[ch] != (int)ch)
+			return 0;
+	}
+	return 1;
+}
+
+int convert_init(struct converter *cv,
+                 enum pcm_format in_format, unsigned int in_channels,
+                 enum pcm_format out_format, unsigned int out_channels,
+                 const int *map, const float *matrix)
+{
+	unsigned int ch;
+
+	memset(cv, 0, sizeof(*cv));
+	cv->in_format = in_format;
+	cv->out_format = out_format;
+	cv->in_channels = in_channels;
+	cv->out_channels = out_channels;
+	cv->in_frame_bytes = convert_sample_bytes(in_format) * in_channels;
+	cv->out_frame_bytes = convert_sample_bytes(out_format) * out_channels;
+
+	if (matrix) {
+		cv->matrix = (float *)malloc(sizeof(float) * out_channels * in_channels);
+		if (!cv->matrix)
+			goto error;
+		memcpy(cv->matrix, matrix, sizeof(float) * out_channels * in_channels);
+	} else {
+		cv->map = (int *)malloc(sizeof(int) * out_channels);
+		if (!cv->map)
+			goto error;
+		for (ch = 0; ch < out_channels; ++ch) {
+			if (map)
+				cv->map[ch] = map[ch] < (int)in_channels ? map[ch] : -1;
+			else
+				cv->map[ch] = ch < in_channels ? (int)ch : -1;
+		}
+		if (convert_is_identity(cv->map, in_channels, out_channels)) {
+			free(cv->map);
+			cv->map = NULL;
+		}
+	}
+
+	if (in_format == out_format && !cv->matrix) {
+		cv->mode = cv->map ? CONVERT_REMAP : CONVERT_COPY;
+		cv->sample_bytes = convert_sample_bytes(in_format);
+		return 0;
+	}
+
+	cv->mode = CONVERT_FLOAT;
+	if (in_format != CONVERT_FORMAT_FLOAT) {
+		cv->to_float = convert_to_float(in_format);
+		if (!cv->to_float)
+			goto error;
+	}
+	if (out_format != CONVERT_FORMAT_FLOAT) {
+		cv->from_float = convert_from_float(out_format);
+		if (!cv->from_float)
+			goto error;
+	}
+	cv->tmp = (float *)malloc(sizeof(float) * CONVERT_BLOCK_FRAMES
+	                          * (in_channels + out_channels));
+	if (!cv->tmp)
+		goto error;
+
+	return 0;
+
+error:
+	convert_free(cv);
+	return -1;
+}
+
+/* Readies the float path and a unity gain on the input or the output
+ * channels. Done once at setup, so that convert_set_gain() never
+ * allocates.
+ */
+int convert_init_gain(struct converter *cv, int input)
+{
+	const unsigned int channels = input ? cv->in_channels : cv->out_channels;
+	unsigned int ch;
+
+	if (!convert_is_supported(cv->in_format) || !convert_is_supported(cv->out_format))
+		return -1;
+	if (cv->in_format != CONVERT_FORMAT_FLOAT)
+		cv->to_float = convert_to_float(cv->in_format);
+	if (cv->out_format != CONVERT_FORMAT_FLOAT)
+		cv->from_float = convert_from_float(cv->out_format);
+	if (!cv->tmp) {
+		cv->tmp = (float *)malloc(sizeof(float) * CONVERT_BLOCK_FRAMES
+		                          * (cv->in_channels + cv->out_channels));
+		if (!cv->tmp)
+			return -1;
+	}
+	cv->gain = (float *)malloc(sizeof(float) * channels * 3);
+	if (!cv->gain)
+		return -1;
+	for (ch = 0; ch < channels; ++ch) {
+		cv->gain[ch] = 1.0f;
+		cv->gain[channels + ch] = 0.0f;
+		cv->gain[channels * 2 + ch] = 1.0f;
+	}
+	cv->gain_channels = channels;
+	cv->gain_input = input;
+	cv->gain_ramp = 0;
+	cv->gain_unity = 1;
+
+	return 0;
+}
+
+static int convert_gain_is_unity(const struct converter *cv)
+{
+	unsigned int ch;
+
+	for (ch = 0; ch < cv->gain_channels; ++ch) {
+		if (cv->gain[ch] != 1.0f)
+			return 0;
+	}
+	return 1;
+}
+
+/* Ramps from the current gain to 'gain' over ramp_frames frames,
+ * or jumps there when ramp_frames is 0.
+ */
+void convert_set_gain(struct converter *cv, const float *gain, size_t ramp_frames)
+{
+	const unsigned int channels = cv->gain_channels;
+	float *step = cv->gain + channels;
+	float *target = step + channels;
+	unsigned int ch;
+
+	for (ch = 0; ch < channels; ++ch) {
+		target[ch] = gain[ch];
+		if (ramp_frames) {
+			step[ch] = (target[ch] - cv->gain[ch]) / ramp_frames;
+		} else {
+			step[ch] = 0.0f;
+			cv->gain[ch] = target[ch];
+		}
+	}
+	cv->gain_ramp = ramp_frames;
+	cv->gain_unity = !ramp_frames && convert_gain_is_unity(cv);
+}
+
+/* dst may be src */
+static void apply_gain(struct converter *cv, float *dst, const float *src, size_t frames)
+{
+	const unsigned int channels = cv->gain_channels;
+	float *g = cv->gain;
+	const float *step = g + channels;
+	const size_t ramp = frames < cv->gain_ramp ? frames : cv->gain_ramp;
+	size_t i;
+	unsigned int ch;
+
+	for (i = 0; i < ramp; ++i) {
+		for (ch = 0; ch < channels; ++ch) {
+			g[ch] += step[ch];
+			dst[ch] = src[ch] * g[ch];
+		}
+		dst += channels;
+		src += channels;
+	}
+	if (ramp) {
+		cv->gain_ramp -= ramp;
+		if (!cv->gain_ramp) {
+			/* land exactly on the target */
+			memcpy(g, step + channels, sizeof(float) * channels);
+			cv->gain_unity = convert_gain_is_unity(cv);
+		}
+	}
+	for (; i < frames; ++i) {
+		for (ch = 0; ch < channels; ++ch)
+			dst[ch] = src[ch] * g[ch];
+		dst += channels;
+		src += channels;
+	}
+}
+
+static void remap(const struct converter *cv, char *dst, const char *src, size_t frames)
+{
+	const size_t sample_bytes = cv->sample_bytes;
+	size_t i;
+	unsigned int ch;
+
+	for (i = 0; i < frames; ++i) {
+		for (ch = 0; ch < cv->out_channels; ++ch) {
+			if (cv->map[ch] < 0)
+				memset(dst + ch * sample_bytes, 0, sample_bytes);
+			else
+				memcpy(dst + ch * sample_bytes, src + cv->map[ch] * sample_bytes,
+				       sample_bytes);
+		}
+		dst += cv->out_frame_bytes;
+		src += cv->in_frame_bytes;
+	}
+}
+
+static void mix_float(const struct converter *cv, float *restrict dst,
+                      const float *restrict src, size_t frames)
+{
+	const unsigned int in_channels = cv->in_channels;
+	const unsigned int out_channels = cv->out_channels;
+	size_t i;
+	unsigned int o, c;
+
+	if (cv->matrix) {
+		for (i = 0; i < frames; ++i) {
+			const float *m = cv->matrix;
+			for (o = 0; o < out_channels; ++o) {
+				float acc = 0.0f;
+				for (c = 0; c < in_channels; ++c)
+					acc += m[c] * src[c];
+				dst[o] = acc;
+				m += in_channels;
+			}
+			dst += out_channels;
+			src += in_channels;
+		}
+	} else {
+		for (i = 0; i < frames; ++i) {
+			for (o = 0; o < out_channels; ++o)
+				dst[o] = cv->map[o] < 0 ? 0.0f : src[cv->map[o]];
+			dst += out_channels;
+			src += in_channels;
+		}
+	}
+}
+
+void convert_run(struct converter *cv, void *dst, const void *src, size_t frames)
+{
+	char *d = (char *)dst;
+	const char *s = (const char *)src;
+	const int gain = cv->gain && !cv->gain_unity;
+	const int mix = cv->map || cv->matrix;
+
+	switch (gain ? CONVERT_FLOAT : cv->mode) {
+	case CONVERT_COPY:
+		memcpy(d, s, frames * cv->in_frame_bytes);
+		break;
+	case CONVERT_REMAP:
+		remap(cv, d, s, frames);
+		break;
+	case CONVERT_FLOAT:
+		if (!mix && !gain && !(cv->to_float && cv->from_float)) {
+			/* a single conversion from or to float */
+			if (cv->to_float)
+				cv->to_float(d, s, frames * cv->in_channels);
+			else
+				cv->from_float(d, s, frames * cv->in_channels);
+			break;
+		}
+		while (frames) {
+			const size_t n = frames < CONVERT_BLOCK_FRAMES ? frames : CONVERT_BLOCK_FRAMES;
+			float *tmp_out = cv->tmp + CONVERT_BLOCK_FRAMES * cv->in_channels;
+			const float *in = (const float *)s;
+			float *out;
+
+			if (cv->to_float) {
+				cv->to_float(cv->tmp, s, n * cv->in_channels);
+				in = cv->tmp;
+			}
+			if (gain && cv->gain_input) {
+				apply_gain(cv, cv->tmp, in, n);
+				in = cv->tmp;
+			}
+			if (mix) {
+				out = cv->from_float ? tmp_out : (float *)d;
+				mix_float(cv, out, in, n);
+			} else {
+				out = (float *)in;
+			}
+			if (gain && !cv->gain_input) {
+				float *g = cv->from_float ? tmp_out : (float *)d;
+				apply_gain(cv, g, out, n);
+				out = g;
+			}
+			if (cv->from_float)
+				cv->from_float(d, out, n * cv->out_channels);
+			else if (out != (float *)d)
+				memcpy(d, out, n * cv->out_frame_bytes);
+
+			d += n * cv->out_frame_bytes;
+			s += n * cv->in_frame_bytes;
+			frames -= n;
+		}
+		break;
+	}
+}
+
+/* Frames per pass of the planar kernels, keeping the strided side of
+ * each channel within L1 while the other channels are walked.
+ */
+#define PLANAR_BLOCK_FRAMES 256
+
+/* Two channels get their own loop, which compilers turn into vector
+ * unpacks; other counts store one channel at a time with a stride.
+ */
+#define DEFINE_PLANAR(bits, type)                                               \
+static void interleave_##bits(type *restrict dst, void *const *planes,          \
+                              size_t offset, unsigned int channels,             \
+                              size_t frames)                                    \
+{                                                                               \
+	size_t i;                                                               \
+	unsigned int ch;                                                        \
+                                                                                \
+	if (channels == 2) {                                                    \
+		const type *restrict l = (const type *)planes[0] + offset;      \
+		const type *restrict r = (const type *)planes[1] + offset;      \
+		for (i = 0; i < frames; ++i) {                                  \
+			dst[2 * i] = l[i];                                      \
+			dst[2 * i + 1] = r[i];                                  \
+		}                                                               \
+		return;                                                         \
+	}                                                                       \
+	for (ch = 0; ch < channels; ++ch) {                                     \
+		const type *restrict p = (const type *)planes[ch] + offset;     \
+		type *restrict d = dst + ch;                                    \
+		for (i = 0; i < frames; ++i)                                    \
+			d[i * channels] = p[i];                                 \
+	}                                                                       \
+}                                                                               \
+                                                                                \
+static void deinterleave_##bits(void *const *planes, size_t offset,             \
+                                const type *restrict src,                       \
+                                unsigned int channels, size_t frames)           \
+{                                                                               \
+	size_t i;                                                               \
+	unsigned int ch;                                                        \
+                                                                                \
+	if (channels == 2) {                                                    \
+		type *restrict l = (type *)planes[0] + offset;                  \
+		type *restrict r = (type *)planes[1] + offset;                  \
+		for (i = 0; i < frames; ++i) {                                  \
+			l[i] = src[2 * i];                                      \
+			r[i] = src[2 * i + 1];                                  \
+		}                                                               \
+		return;                                                         \
+	}                                                                       \
+	for (ch = 0; ch < channels; ++ch) {                                     \
+		type *restrict p = (type *)planes[ch] + offset;                 \
+		const type *restrict s = src + ch;                              \
+		for (i = 0; i < frames; ++i)                                    \
+			p[i] = s[i * channels];                                 \
+	}                                                                       \
+}
+
+DEFINE_PLANAR(16, uint16_t)
+DEFINE_PLANAR(32, uint32_t)
+
+void convert_interleave(void *dst, void *const *planes, size_t offset,
+                        unsigned int channels, size_t sample_bytes, size_t frames)
+{
+	char *d = (char *)dst;
+	const size_t frame_bytes = sample_bytes * channels;
+
+	while (frames) {
+		const size_t n = frames < PLANAR_BLOCK_FRAMES ? frames : PLANAR_BLOCK_FRAMES;
+		size_t i;
+		unsigned int ch;
+
+		switch (sample_bytes) {
+		case 2:
+			interleave_16((uint16_t *)d, planes, offset, channels, n);
+			break;
+		case 4:
+			interleave_32((uint32_t *)d, planes, offset, channels, n);
+			break;
+		default:
+			for (ch = 0; ch < channels; ++ch) {
+				const char *p = (const char *)planes[ch] + offset * sample_bytes;
+				for (i = 0; i < n; ++i)
+					memcpy(d + i * frame_bytes + ch * sample_bytes,
+					       p + i * sample_bytes, sample_bytes);
+			}
+			break;
+		}
+		d += n * frame_bytes;
+		offset += n;
+		frames -= n;
+	}
+}
+
+void convert_deinterleave(void *const *planes, size_t offset, const void *src,
+                          unsigned int channels, size_t sample_bytes, size_t frames)
+{
+	const char *s = (const char *)src;
+	const size_t frame_bytes = sample_bytes * channels;
+
+	while (frames) {
+		const size_t n = frames < PLANAR_BLOCK_FRAMES ? frames : PLANAR_BLOCK_FRAMES;
+		size_t i;
+		unsigned int ch;
+
+		switch (sample_bytes) {
+		case 2:
+			deinterleave_16(planes, offset, (const uint16_t *)s, channels, n);
+			break;
+		case 4:
+			deinterleave_32(planes, offset, (const uint32_t *)s, channels, n);
+			break;
+		default:
+			for (ch = 0; ch < channels; ++ch) {
+				char *p = (char *)planes[ch] + offset * sample_bytes;
+				for (i = 0; i < n; ++i)
+					memcpy(p + i * sample_bytes,
+					       s + i * frame_bytes + ch * sample_bytes, sample_bytes);
+			}
+			break;
+		}
+		s += n * frame_bytes;
+		offset += n;
+		frames -= n;
+	}
+}
+
+void convert_free(struct converter *cv)
+{
+	free(cv->map);
+	cv->map = NULL;
+	free(cv->matrix);
+	cv->matrix = NULL;
+	free(cv->tmp);
+	cv->tmp = NULL;
+	free(cv->gain);
+	cv->gain = NULL;
+}
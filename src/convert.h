@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __CONVERT_H__
+#define __CONVERT_H__
+
+#include <stddef.h>
+#include <tinyalsa/asoundlib.h>
+
+/* tinyalsa has no float format, the ring uses the value past its enum */
+#define CONVERT_FORMAT_FLOAT ((enum pcm_format)PCM_FORMAT_MAX)
+
+/* Converts 'samples' samples between a PCM format and float32 in the
+ * range [-1.0, 1.0). Conversions to integer formats saturate.
+ */
+typedef void (*convert_func)(void *dst, const void *src, size_t samples);
+
+convert_func convert_to_float(enum pcm_format format);
+convert_func convert_from_float(enum pcm_format format);
+int convert_is_supported(enum pcm_format format);
+size_t convert_sample_bytes(enum pcm_format format);
+
+enum convert_mode {
+	CONVERT_COPY,		/* same layout */
+	CONVERT_REMAP,		/* same format, channels picked by map */
+	CONVERT_FLOAT,		/* anything else, through float blocks */
+};
+
+/* Converts frames from one layout to another: sample format, and channel
+ * remapping or mixing, fused into one pass over cache sized blocks.
+ * map[out] is the input channel feeding each output channel, or -1 for
+ * silence; matrix is [out][in] gains. Without both, the first channels
+ * are kept and extra output channels are silent.
+ *
+ * An optional gain stage, on the input or the output channels, ramps
+ * linearly per frame. It switches the copy and remap modes to the float
+ * blocks only while the gain is not unity.
+ */
+struct converter {
+	enum convert_mode mode;
+	enum pcm_format in_format;
+	enum pcm_format out_format;
+	unsigned int in_channels;
+	unsigned int out_channels;
+	size_t in_frame_bytes;
+	size_t out_frame_bytes;
+	size_t sample_bytes;	/* CONVERT_REMAP */
+	convert_func to_float;	/* NULL when the input is float */
+	convert_func from_float;	/* NULL when the output is float */
+	int *map;
+	float *matrix;
+	float *tmp;
+	float *gain;		/* current, per frame step and target gains */
+	unsigned int gain_channels;
+	int gain_input;		/* gain applied before mixing */
+	size_t gain_ramp;	/* frames left in the ramp */
+	int gain_unity;
+};
+
+int convert_init(struct converter *cv,
+                 enum pcm_format in_format, unsigned int in_channels,
+                 enum pcm_format out_format, unsigned int out_channels,
+                 const int *map, const float *matrix);
+int convert_init_gain(struct converter *cv, int input);
+void convert_set_gain(struct converter *cv, const float *gain, size_t ramp_frames);
+void convert_run(struct converter *cv, void *dst, const void *src, size_t frames);
+void convert_free(struct converter *cv);
+
+/* Moves frames between an interleaved buffer and one buffer per channel,
+ * starting 'offset' samples into the channel buffers.
+ */
+void convert_interleave(void *dst, void *const *planes, size_t offset,
+                        unsigned int channels, size_t sample_bytes, size_t frames);
+void convert_deinterleave(void *const *planes, size_t offset, const void *src,
+                          unsigned int channels, size_t sample_bytes, size_t frames);
+
+#endif
@@ -25,17 +25,46 @@
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
-#include <assert.h>
 #include "queue.h"
 #include "resampler.h"
+#include "tuner.h"
+#include "convert.h"
+#include "backend.h"
+#include "histogram.h"
+#include "seqlock.h"
+#include "latency.h"
 
 enum epcm_direction {
 	EPCM_OUT = 0,
 	EPCM_IN  = 1
 };
 
+/* Client side counters of epcm_get_stats(), written by epcm_read() or
+ * epcm_write() only.
+ */
+struct epcm_appl_stats {
+	unsigned int seq;
+	uint64_t frames;
+	double tuner_ppm;
+	uint64_t tuner_frames[EPCM_TUNER_STEPS];
+};
+
+/* Frames staged in planar_buf per pass of epcm_readn()/epcm_writen() */
+#define EPCM_PLANAR_FRAMES 256
+
+/* Per-channel buffers of one epcm_readn()/epcm_writen() call. The queue
+ * advances through them as if they were channel 0 with one sample per
+ * frame, so the copy finds the offset from that position.
+ */
+struct epcm_planar {
+	struct epcm *epcm;
+	void **bufs;
+	const char *base;	/* bufs[0] */
+	size_t sample_bytes;
+};
+
 struct epcm {
-	struct pcm *pcm;
+	struct backend be;
 
 	/* extention */
 	enum epcm_direction dir;
@@ -43,11 +72,144 @@ struct epcm {
 	pthread_t tid;
 	int stop;
 	struct resampler *rs;
+	char *rs_buf;
+	size_t rs_buf_frames;
+	struct tuner tuner;
+	int tuner_started;
+
+	/* client side layout, converted from/to the device in the ring copies */
+	unsigned int channels;
+	size_t frame_bytes;
+	enum pcm_format ring_format;
+	struct converter hw_conv;	/* device <-> ring */
+	struct converter appl_conv;	/* ring <-> client */
+	char *conv_buf;		/* one period of client frames in the ring format */
+	char *planar_buf;	/* EPCM_PLANAR_FRAMES interleaved client frames */
+
+	/* gain update handed over to pcm_streaming_thread */
+	pthread_mutex_t gain_mutex;
+	float *gain_pending;
+	size_t gain_ramp_frames;
+	int gain_dirty;		/* atomic, polled without the mutex */
+
+	/* epcm_open_callback(), run by pcm_streaming_thread on the ring */
+	void (*callback)(void *arg, void *frames, unsigned int count);
+	void *callback_arg;
+	size_t callback_ahead;	/* frames rendered ahead of the device */
+
+	/* pcm_streaming_thread scheduling, with epcm_config.histograms */
+	struct epcm_histogram *hist;
+	struct epcm_appl_stats appl_stats;
 };
 
 struct pcm *epcm_base(struct epcm *epcm)
 {
-	return epcm->pcm;
+	return epcm->be.pcm;
+}
+
+int epcm_get_config(struct epcm *epcm, struct pcm_config *config,
+                    unsigned int *ram_millisecs)
+{
+	struct queue *q = &epcm->q;
+
+	if (config)
+		*config = epcm->be.config;
+	if (ram_millisecs) {
+		*ram_millisecs = 0;
+		if (q->ram_size)
+			*ram_millisecs = (uint64_t)queue_bytes_to_frames(q, q->ram_size)
+			                 * 1000 / epcm->be.config.rate;
+	}
+
+	return 0;
+}
+
+static uint64_t epcm_now_usecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void epcm_appl_account(struct epcm *epcm, size_t frames)
+{
+	struct epcm_appl_stats *s = &epcm->appl_stats;
+
+	seqlock_write_begin(&s->seq);
+	s->frames += frames;
+	if (epcm->rs) {
+		const struct tuner *t = &epcm->tuner;
+		int step = (int)((t->ppm + t->max_ppm) * EPCM_TUNER_STEPS / (2 * t->max_ppm));
+
+		if (step < 0)
+			step = 0;
+		else if (step >= EPCM_TUNER_STEPS)
+			step = EPCM_TUNER_STEPS - 1;
+		s->tuner_ppm = t->ppm;
+		s->tuner_frames[step] += frames;
+	}
+	seqlock_write_end(&s->seq);
+}
+
+/* Runs the callback in place on count ring frames, through planar_buf
+ * when the client format differs from the ring one.
+ */
+static void epcm_callback_run(struct epcm *epcm, char *ring, size_t frames)
+{
+	struct converter *cv = &epcm->appl_conv;
+
+	epcm_appl_account(epcm, frames);
+	if (cv->mode == CONVERT_COPY) {
+		epcm->callback(epcm->callback_arg, ring, frames);
+		return;
+	}
+	while (frames) {
+		const size_t n = frames < EPCM_PLANAR_FRAMES ? frames : EPCM_PLANAR_FRAMES;
+
+		if (epcm->dir == EPCM_IN) {
+			convert_run(cv, epcm->planar_buf, ring, n);
+			epcm->callback(epcm->callback_arg, epcm->planar_buf, n);
+		} else {
+			epcm->callback(epcm->callback_arg, epcm->planar_buf, n);
+			convert_run(cv, ring, epcm->planar_buf, n);
+		}
+		ring += n * epcm->q.frame_bytes;
+		frames -= n;
+	}
+}
+
+/* Renders until the ring holds the next device transfer, plus the frames
+ * kept ahead.
+ */
+static void epcm_callback_fill(struct epcm *epcm)
+{
+	struct queue *q = &epcm->q;
+	const size_t target = (epcm->be.buffer_size + epcm->callback_ahead) * q->frame_bytes;
+	size_t data_size;
+
+	while ((data_size = queue_get_data_size_l(q)) < target) {
+		size_t bytes;
+		char *ring = queue_appl_write_begin(q, &bytes);
+
+		if (bytes > target - data_size)
+			bytes = target - data_size;
+		epcm_callback_run(epcm, ring, queue_bytes_to_frames(q, bytes));
+		queue_appl_write_commit(q, bytes);
+	}
+}
+
+/* Hands everything captured to the callback */
+static void epcm_callback_drain(struct epcm *epcm)
+{
+	struct queue *q = &epcm->q;
+	size_t bytes;
+	char *ring;
+
+	while ((ring = queue_appl_read_begin(q, &bytes)), bytes) {
+		epcm_callback_run(epcm, ring, queue_bytes_to_frames(q, bytes));
+		queue_appl_read_commit(q, bytes);
+	}
 }
 
 static void *pcm_streaming_thread(void *data)
@@ -55,9 +217,11 @@ static void *pcm_streaming_thread(void *data)
 	KLOGD("%s() enter", __FUNCTION__);
 
 	struct epcm *epcm = (struct epcm *)data;
-	struct pcm *pcm = epcm->pcm;
-	const size_t bytes = pcm_frames_to_bytes(pcm, pcm_get_buffer_size(pcm));
+	struct backend *be = &epcm->be;
+	struct epcm_histogram *hist = epcm->hist;
+	const size_t bytes = be->buffer_size * be->frame_bytes;
 	char *buf = (char *)malloc(bytes);
+	uint64_t wakeup = 0, t0 = 0, t1 = 0, t2 = 0;
 
 	if (!buf) {
 		KLOGE("Failed to alloc %u bytes", bytes);
@@ -65,22 +229,49 @@ static void *pcm_streaming_thread(void *data)
 	}
 
 	while (!epcm->stop) {
+		if (hist) {
+			t0 = epcm_now_usecs();
+			if (wakeup)
+				histogram_add(&hist[EPCM_HIST_WAKEUP], t0 - wakeup);
+			wakeup = t0;
+			/* data_size moves under the lock, this thread writes the stats */
+			histogram_add(&hist[EPCM_HIST_LEVEL], epcm->q.stats.level);
+		}
+
 		if (epcm->dir == EPCM_IN) {
-			if (pcm_read(pcm, buf, bytes) != 0) {
-				KLOGE("Error to pcm_read(%u bytes)", bytes);
+			if (backend_read(be, buf, bytes) != 0) {
+				KLOGE("Error to read(%u bytes)", bytes);
 				continue;
 			}
+			if (hist)
+				t1 = epcm_now_usecs();
 			if (queue_hw_write(&epcm->q, buf, bytes) != 0) {
 				KLOGE("Error to queue_hw_write(%u bytes)", bytes);
 			}
+			if (epcm->callback)
+				epcm_callback_drain(epcm);
+			if (hist) {
+				t2 = epcm_now_usecs();
+				histogram_add(&hist[EPCM_HIST_DEVICE], t1 - t0);
+				histogram_add(&hist[EPCM_HIST_QUEUE], t2 - t1);
+			}
 		} else {
+			if (epcm->callback)
+				epcm_callback_fill(epcm);
 			if (queue_hw_read(&epcm->q, buf, bytes) != 0) {
 				KLOGE("Error to queue_hw_read(%u bytes)", bytes);
 				continue;
 			}
+			if (hist)
+				t1 = epcm_now_usecs();
 
-			if (pcm_write(pcm, buf, bytes) != 0) {
-				KLOGE("Error to pcm_write(%u bytes)", bytes);
+			if (backend_write(be, buf, bytes) != 0) {
+				KLOGE("Error to write(%u bytes)", bytes);
+			}
+			if (hist) {
+				t2 = epcm_now_usecs();
+				histogram_add(&hist[EPCM_HIST_QUEUE], t1 - t0);
+				histogram_add(&hist[EPCM_HIST_DEVICE], t2 - t1);
 			}
 		}
 	}
@@ -91,6 +282,219 @@ error:
 	return NULL;
 }
 
+static void epcm_queue_copy(const struct queue_xfer *x, void *dst,
+                            const void *src, size_t frames)
+{
+	convert_run((struct converter *)x->priv, dst, src, frames);
+}
+
+/* Picks up a pending gain without ever blocking the streaming thread,
+ * a busy mutex just defers it to the next transfer.
+ */
+static void epcm_hw_copy(const struct queue_xfer *x, void *dst,
+                         const void *src, size_t frames)
+{
+	struct epcm *epcm = (struct epcm *)x->priv;
+
+	if (__atomic_load_n(&epcm->gain_dirty, __ATOMIC_RELAXED) &&
+	    pthread_mutex_trylock(&epcm->gain_mutex) == 0) {
+		convert_set_gain(&epcm->hw_conv, epcm->gain_pending, epcm->gain_ramp_frames);
+		__atomic_store_n(&epcm->gain_dirty, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&epcm->gain_mutex);
+	}
+	convert_run(&epcm->hw_conv, dst, src, frames);
+}
+
+static enum pcm_format epcm_client_format(enum epcm_format format,
+                                          enum pcm_format device_format)
+{
+	switch (format) {
+	case EPCM_FORMAT_S16_LE:
+		return PCM_FORMAT_S16_LE;
+	case EPCM_FORMAT_S24_LE:
+		return PCM_FORMAT_S24_LE;
+	case EPCM_FORMAT_S24_3LE:
+		return PCM_FORMAT_S24_3LE;
+	case EPCM_FORMAT_S32_LE:
+		return PCM_FORMAT_S32_LE;
+	case EPCM_FORMAT_FLOAT_LE:
+		return CONVERT_FORMAT_FLOAT;
+	case EPCM_FORMAT_DEVICE:
+	default:
+		return device_format;
+	}
+}
+
+/* The ring holds client frames, in float on the float path. Device side
+ * conversion runs in pcm_streaming_thread as part of the ring copy.
+ */
+static int epcm_convert_open(struct epcm *epcm, const struct epcm_config *econfig)
+{
+	struct backend *be = &epcm->be;
+	const enum pcm_format device_format = be->config.format;
+	const unsigned int device_channels = be->config.channels;
+	const enum pcm_format client_format = epcm_client_format(econfig->format, device_format);
+	enum pcm_format ring_format = client_format;
+	int ret;
+
+	if (client_format != device_format &&
+	    (!convert_is_supported(device_format) || !convert_is_supported(client_format))) {
+		KLOGE("No conversion from format %d to %d", device_format, client_format);
+		return -1;
+	}
+	if (econfig->float_path) {
+		if (convert_is_supported(device_format) && convert_is_supported(client_format))
+			ring_format = CONVERT_FORMAT_FLOAT;
+		else
+			KLOGW("No float conversion for format %d, float path disabled",
+			      device_format);
+	}
+
+	epcm->channels = econfig->channels ? econfig->channels : device_channels;
+	epcm->frame_bytes = convert_sample_bytes(client_format) * epcm->channels;
+	epcm->ring_format = ring_format;
+
+	if (epcm->dir == EPCM_IN) {
+		ret = convert_init(&epcm->hw_conv, device_format, device_channels,
+		                   ring_format, epcm->channels,
+		                   econfig->chmap, econfig->chmatrix);
+		if (ret == 0)
+			ret = convert_init(&epcm->appl_conv, ring_format, epcm->channels,
+			                   client_format, epcm->channels, NULL, NULL);
+	} else {
+		ret = convert_init(&epcm->hw_conv, ring_format, epcm->channels,
+		                   device_format, device_channels,
+		                   econfig->chmap, econfig->chmatrix);
+		if (ret == 0)
+			ret = convert_init(&epcm->appl_conv, client_format, epcm->channels,
+			                   ring_format, epcm->channels, NULL, NULL);
+	}
+	if (ret != 0)
+		return ret;
+
+	/* the gain is on the client channels, at the device side of the ring */
+	if (convert_init_gain(&epcm->hw_conv, epcm->dir == EPCM_OUT) == 0)
+		epcm->gain_pending = (float *)calloc(epcm->channels, sizeof(float));
+	if (!epcm->gain_pending)
+		KLOGW("No gain stage for format %d", device_format);
+
+	return 0;
+}
+
+/* The hw side always converts between the device and the ring layout.
+ * The appl side does the same unless the tuner is in between, which then
+ * resamples in the ring layout and converts on its own.
+ */
+static void epcm_xfer_init(struct epcm *epcm)
+{
+	struct queue *q = &epcm->q;
+
+	q->hw_xfer.frame_bytes = epcm->be.frame_bytes;
+	if (epcm->gain_pending) {
+		q->hw_xfer.priv = epcm;
+		q->hw_xfer.copy = epcm_hw_copy;
+	} else {
+		q->hw_xfer.priv = &epcm->hw_conv;
+		q->hw_xfer.copy = epcm->hw_conv.mode == CONVERT_COPY ? NULL : epcm_queue_copy;
+	}
+
+	if (epcm->rs) {
+		q->appl_xfer.frame_bytes = q->frame_bytes;
+		q->appl_xfer.copy = NULL;
+	} else {
+		q->appl_xfer.frame_bytes = epcm->frame_bytes;
+		q->appl_xfer.priv = &epcm->appl_conv;
+		q->appl_xfer.copy = epcm->appl_conv.mode == CONVERT_COPY ? NULL : epcm_queue_copy;
+	}
+}
+
+static void epcm_tuner_open(struct epcm *epcm, const struct epcm_config *econfig,
+                            size_t ram_frames)
+{
+	struct backend *be = &epcm->be;
+	const unsigned int rate = be->config.rate;
+	const size_t buffer_frames = be->buffer_size;
+	const unsigned int max_ppm = econfig->tuner_max_ppm ?
+	                             econfig->tuner_max_ppm : TUNER_DEFAULT_MAX_PPM;
+	const size_t period_frames = be->config.period_size;
+	size_t target_frames = ram_frames / 2;
+
+	if (epcm->ring_format != CONVERT_FORMAT_FLOAT &&
+	    epcm->ring_format != PCM_FORMAT_S16_LE) {
+		KLOGW("tuner: needs S16_LE or the float path, tuner disabled");
+		return;
+	}
+	if (max_ppm >= 100000) {
+		KLOGE("tuner: max %u ppm is too large, tuner disabled", max_ppm);
+		return;
+	}
+	/* one period at the highest ratio, in either direction */
+	epcm->rs_buf_frames = (uint64_t)period_frames * 1000000 / (1000000 - max_ppm) + 2;
+
+	if (econfig->tuner_target_millisecs)
+		target_frames = (uint64_t)rate * econfig->tuner_target_millisecs / 1000;
+	/* keep one hardware buffer of headroom on both sides */
+	if (target_frames < buffer_frames || target_frames > ram_frames - buffer_frames) {
+		KLOGW("tuner: target %u frames out of range, using %u",
+		      target_frames, ram_frames / 2);
+		target_frames = ram_frames / 2;
+	}
+
+	epcm->rs = rs_open(epcm->channels,
+	                   epcm->ring_format == CONVERT_FORMAT_FLOAT ? RS_FORMAT_FLOAT : RS_FORMAT_S16,
+	                   rate, rate);
+	epcm->rs_buf = (char *)malloc(epcm->rs_buf_frames * epcm->q.frame_bytes);
+	if (epcm->appl_conv.mode != CONVERT_COPY)
+		epcm->conv_buf = (char *)malloc(period_frames * epcm->q.frame_bytes);
+	if (!epcm->rs || !epcm->rs_buf ||
+	    (epcm->appl_conv.mode != CONVERT_COPY && !epcm->conv_buf)) {
+		KLOGW("Failed to open resampler, tuner disabled");
+		rs_close(epcm->rs);
+		epcm->rs = NULL;
+		free(epcm->rs_buf);
+		epcm->rs_buf = NULL;
+		free(epcm->conv_buf);
+		epcm->conv_buf = NULL;
+		return;
+	}
+
+	tuner_init(&epcm->tuner, rate, target_frames, max_ppm,
+	           econfig->tuner_kp, econfig->tuner_ki);
+	KLOGD("tuner: target=%u frames, max=%u ppm", target_frames, max_ppm);
+}
+
+/* Fill level of the extended buffer in frames, interpolated in between
+ * the buffer sized transfers of pcm_streaming_thread so that it moves
+ * smoothly at the device rate.
+ */
+static double epcm_get_level(struct epcm *epcm)
+{
+	struct backend *be = &epcm->be;
+	uint64_t usecs = 0;
+	const size_t data_size = queue_get_data_size_since_hw(&epcm->q, &usecs);
+	const double elapsed = (double)usecs * be->config.rate / 1000000.0;
+	const double frames = queue_bytes_to_frames(&epcm->q, data_size);
+
+	if (epcm->dir == EPCM_IN)
+		return frames + elapsed;
+	else
+		return frames + be->buffer_size - elapsed;
+}
+
+/* Capture resamples queue frames to client frames and playback client
+ * frames to queue frames, both at (1 + ppm) input frames per output frame.
+ */
+static void epcm_tuner_update(struct epcm *epcm, size_t frames)
+{
+	struct tuner *t = &epcm->tuner;
+
+	tuner_update(t, epcm_get_level(epcm), frames);
+	rs_adjust(epcm->rs, 1000000000, 1000000000 + (long)(t->ppm * 1000));
+	trace_add(epcm->q.trace, EPCM_TRACE_TUNER, (size_t)t->level, (long)t->ppm);
+	HOT_KLOGV("tuner: level=%d frames, ratio=%d ppm",
+	          (int)(t->level - t->target), (int)t->ppm);
+}
+
 struct epcm *epcm_open(unsigned int card,
                        unsigned int device,
                        unsigned int flags,
@@ -106,14 +510,27 @@ struct epcm *epcm_open(unsigned int card,
 		goto error;
 	}
 
-	epcm->pcm = pcm_open(card, device, flags, config);
-	if (!epcm->pcm) {
-		KLOGE("Unable to open PCM device");
-		goto error;
+	struct pcm_config auto_config;
+	struct epcm_config auto_econfig;
+	if (econfig->target_latency_millisecs) {
+		struct latency_ranges ranges;
+
+		auto_config = *config;
+		auto_econfig = *econfig;
+		latency_get_ranges(&ranges, card, device, flags, !!econfig->virtual_device);
+		if (latency_pick(&ranges, econfig->robustness, econfig->target_latency_millisecs,
+		                 !(flags & PCM_IN), &auto_config, &auto_econfig.ram_millisecs) != 0)
+			goto error;
+		config = &auto_config;
+		econfig = &auto_econfig;
 	}
-	if (!pcm_is_ready(epcm->pcm)) {
-		KLOGE("Unable to open PCM device (%s)", pcm_get_error(epcm->pcm));
-		goto error;
+
+	if (econfig->virtual_device) {
+		if (backend_open_virtual(&epcm->be, flags, config, econfig->virtual_device) != 0)
+			goto error;
+	} else {
+		if (backend_open_pcm(&epcm->be, card, device, flags, config) != 0)
+			goto error;
 	}
 
 	epcm->dir = !!(flags & (0x1u << 28));
@@ -121,13 +538,21 @@ struct epcm *epcm_open(unsigned int card,
 	q = &epcm->q;
 
 	if (econfig->ram_millisecs) {
-		size_t ram_frames = (uint64_t)pcm_get_rate(epcm->pcm)
+		size_t ram_frames = (uint64_t)epcm->be.config.rate
 		                    * (uint64_t)econfig->ram_millisecs / (uint64_t)1000;
-		if (ram_frames < pcm_get_buffer_size(epcm->pcm) * 3) {
+		/* the device may grant a larger buffer than negotiated */
+		if (econfig->target_latency_millisecs && ram_frames < epcm->be.buffer_size * 3)
+			ram_frames = epcm->be.buffer_size * 3;
+		if (ram_frames < epcm->be.buffer_size * 3) {
 			KLOGE("Too small RAM size");
 			goto error;
 		}
-		q->ram_size = pcm_frames_to_bytes(epcm->pcm, ram_frames);
+		if (epcm_convert_open(epcm, econfig) != 0) {
+			KLOGE("Unsupported channel or format conversion");
+			goto error;
+		}
+		q->frame_bytes = convert_sample_bytes(epcm->ring_format) * epcm->channels;
+		q->ram_size = ram_frames * q->frame_bytes;
 		KLOGD("ram_size=%u", q->ram_size);
 		q->ram = (char *)malloc(q->ram_size);
 		if (!q->ram) {
@@ -142,11 +567,32 @@ struct epcm *epcm_open(unsigned int card,
 
 			pthread_mutex_init(&q->mutex_for_hw_pos, (const pthread_mutexattr_t *)NULL);
 			pthread_cond_init(&q->cond, (const pthread_condattr_t *)NULL);
+			pthread_mutex_init(&epcm->gain_mutex, (const pthread_mutexattr_t *)NULL);
+
+			if (econfig->tuner)
+				epcm_tuner_open(epcm, econfig, ram_frames);
+			epcm_xfer_init(epcm);
 
-			if (econfig->tuner && config->format == PCM_FORMAT_S16_LE)
-				epcm->rs = rs_open(config->channels, config->rate, config->rate);
+			if (econfig->histograms) {
+				epcm->hist = (struct epcm_histogram *)calloc(EPCM_HIST_COUNT,
+				                                             sizeof(struct epcm_histogram));
+				if (!epcm->hist)
+					KLOGW("Failed to alloc histograms");
+			}
+			if (econfig->trace_events) {
+				q->trace = trace_open(econfig->trace_events);
+				if (!q->trace)
+					KLOGW("Failed to alloc the trace");
+			}
 		}
 	} else {
+		if (econfig->channels || econfig->chmap || econfig->chmatrix ||
+		    econfig->format != EPCM_FORMAT_DEVICE) {
+			KLOGE("Channel or format conversion needs the extended buffer");
+			goto error;
+		}
+		if (econfig->histograms || econfig->trace_events)
+			KLOGW("Histograms and trace need the extended buffer");
 		q->ram = NULL;
 		q->ram_size = 0;
 	}
@@ -160,102 +606,405 @@ error:
 	return NULL;
 }
 
+/* epcm_get_stats() may read tid from any thread, it is published once
+ * the thread exists.
+ */
+static int epcm_thread_start(struct epcm *epcm)
+{
+	pthread_t tid;
+	int ret;
+
+	ret = pthread_create(&tid, NULL, pcm_streaming_thread, epcm);
+	if (ret != 0) {
+		KLOGE("Failed to create pcm_streaming_thread");
+		return ret;
+	}
+	__atomic_store_n(&epcm->tid, tid, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+struct epcm *epcm_open_callback(unsigned int card,
+                                unsigned int device,
+                                unsigned int flags,
+                                const struct pcm_config *config,
+                                const struct epcm_config *econfig,
+                                void (*callback)(void *arg, void *frames,
+                                                 unsigned int count),
+                                void *arg)
+{
+	struct epcm_config cb_config = *econfig;
+	struct epcm *epcm;
+
+	if (!econfig->ram_millisecs) {
+		KLOGE("Callbacks need the extended buffer");
+		return NULL;
+	}
+	if (econfig->tuner)
+		KLOGW("No tuner with callbacks, both sides run on the device clock");
+	cb_config.tuner = 0;
+
+	epcm = epcm_open(card, device, flags, config, &cb_config);
+	if (!epcm)
+		return NULL;
+	if (!epcm->q.ram_size)
+		goto error;
+	if (epcm->appl_conv.mode != CONVERT_COPY) {
+		epcm->planar_buf = (char *)malloc(EPCM_PLANAR_FRAMES * epcm->frame_bytes);
+		if (!epcm->planar_buf) {
+			KLOGE("Failed to alloc %u bytes", EPCM_PLANAR_FRAMES * epcm->frame_bytes);
+			goto error;
+		}
+	}
+
+	epcm->callback = callback;
+	epcm->callback_arg = arg;
+	if (epcm->dir == EPCM_OUT && econfig->callback_ahead)
+		epcm->callback_ahead = epcm->be.config.period_size;
+
+	if (epcm_thread_start(epcm) != 0)
+		goto error;
+
+	return epcm;
+
+error:
+	epcm_close(epcm);
+	return NULL;
+}
+
+static int epcm_start_capture(struct epcm *epcm)
+{
+	int ret = 0;
+
+	if (!epcm->tid)
+		ret = epcm_thread_start(epcm);
+
+	return ret;
+}
+
 int epcm_read(struct epcm *epcm, void *data, unsigned int count)
 {
 	struct queue *q = &epcm->q;
 
+	if (epcm->callback) {
+		KLOGE("The stream is driven by its callback");
+		return -1;
+	}
 	if (q->ram_size) {
-		if (!epcm->tid) {
-			int ret;
+		int ret = epcm_start_capture(epcm);
+		struct backend *be = &epcm->be;
 
-			ret = pthread_create(&epcm->tid, NULL, pcm_streaming_thread, epcm);
-			if (ret != 0) {
-				KLOGE("Failed to create pcm_streaming_thread");
-				return ret;
+		if (ret != 0)
+			return ret;
+
+		if (epcm->rs) {
+			/* The scratch buffer holds one period at the highest ratio,
+			 * so larger reads are tuned period by period.
+			 */
+			const size_t period_frames = be->config.period_size;
+			char *dst = (char *)data;
+			size_t frames = count / epcm->frame_bytes;
+
+			if (!epcm->tuner_started) {
+				/* start from the target level */
+				queue_wait_data_size(q, (size_t)epcm->tuner.target * q->frame_bytes);
+				epcm->tuner_started = 1;
 			}
-		}
 
-		int ret = -1;
-		struct pcm *pcm = epcm->pcm;
-		const unsigned int rate = pcm_get_rate(pcm);
-		const size_t tuning_threshold_too_low = q->ram_size * 1 / 5;
-		const size_t tuning_threshold_low = q->ram_size * 2 / 5;
-		const size_t tuning_threshold_high = q->ram_size * 3 / 5;
-		const size_t tuning_threshold_too_high = q->ram_size * 4 / 5;
-		size_t avail = queue_get_data_size_l(q);
-		size_t newcount = count;
+			while (frames && ret == 0) {
+				size_t dst_frames = frames < period_frames ? frames : period_frames;
+				size_t src_frames;
 
-		if (epcm->rs) {
-			if (avail < tuning_threshold_too_low) {
-				KLOGV("tuner: Buffer data is too less now, further slowing down the reading");
-				newcount = count * 29 / 32;
-				rs_adjust(epcm->rs, rate, rate * 29 / 32);
-			} else if (tuning_threshold_too_low <= avail && avail < tuning_threshold_low) {
-				KLOGV("Buffer data is less now, slowing down the reading");
-				newcount = count * 31 / 32;
-				rs_adjust(epcm->rs, rate, rate * 31 / 32);
-			} else if (tuning_threshold_low <= avail && avail < tuning_threshold_high) {
-				KLOGV("tuner: Normal threshold");
-				newcount = count;
-				rs_adjust(epcm->rs, rate, rate);
-			} else if (tuning_threshold_high <= avail && avail < tuning_threshold_too_high) {
-				KLOGV("tuner: Buffer data is more now, speeding up the reading");
-				newcount = count * 33 / 32;
-				rs_adjust(epcm->rs, rate, rate * 33 / 32);
-			} else if (tuning_threshold_too_high <= avail) {
-				KLOGV("tuner: Buffer data is much more now, further speeding up the reading");
-				newcount = count * 35 / 32;
-				rs_adjust(epcm->rs, rate, rate * 35 / 32);
+				epcm_tuner_update(epcm, dst_frames);
+				src_frames = rs_get_src_frames(epcm->rs, dst_frames);
+				ret = queue_appl_read(q, epcm->rs_buf, src_frames * q->frame_bytes);
+				if (epcm->conv_buf) {
+					rs_process(epcm->rs, epcm->conv_buf, &dst_frames,
+					           epcm->rs_buf, &src_frames);
+					convert_run(&epcm->appl_conv, dst, epcm->conv_buf, dst_frames);
+				} else {
+					rs_process(epcm->rs, dst, &dst_frames, epcm->rs_buf, &src_frames);
+				}
+				epcm_appl_account(epcm, dst_frames);
+				dst += dst_frames * epcm->frame_bytes;
+				frames -= dst_frames;
 			}
-			static char tmp[10 * 1024 * 1024];
-			assert(newcount <= sizeof(tmp));
-			ret = queue_appl_read(q, tmp, newcount);
-			rs_process(epcm->rs, data, pcm_bytes_to_frames(pcm, count),
-					tmp, pcm_bytes_to_frames(pcm, newcount));
 		} else {
 			ret = queue_appl_read(q, data, count);
+			if (ret == 0)
+				epcm_appl_account(epcm, count / epcm->frame_bytes);
 		}
 
 		return ret;
 	} else {
-		return pcm_read(epcm->pcm, data, count);
+		return backend_read(&epcm->be, data, count);
 	}
 }
 
+/* The start_threshold is set to 2 * pcm_get_buffer_size().
+ * The reason is the first pcm_get_buffer_size() will be written
+ * to kernel buffer immediately, and the second pcm_get_buffer_size()
+ * will be read out of queue also immediately. After the two
+ * pcm_get_buffer_size(), kernel is consuming the data at the speed of
+ * sampling rate.
+ * With the tuner, the level left after those two transfers is the
+ * target, bounded so that writes of up to one period can reach it.
+ */
+static int epcm_start_playback(struct epcm *epcm)
+{
+	struct queue *q = &epcm->q;
+	struct backend *be = &epcm->be;
+	size_t threshold = 2 * be->buffer_size;
+	int ret = 0;
+
+	if (epcm->rs) {
+		const size_t limit = queue_bytes_to_frames(q, q->ram_size)
+		                     - be->config.period_size;
+		threshold = (size_t)epcm->tuner.target + be->buffer_size;
+		if (threshold > limit)
+			threshold = limit;
+	}
+
+	if (!epcm->tid && queue_bytes_to_frames(q, q->written) > threshold)
+		ret = epcm_thread_start(epcm);
+
+	return ret;
+}
+
 int epcm_write(struct epcm *epcm, const void *data, unsigned int count)
 {
 	struct queue *q = &epcm->q;
 
+	if (epcm->callback) {
+		KLOGE("The stream is driven by its callback");
+		return -1;
+	}
 	if (q->ram_size) {
-		/* The start_threshold is set to 2 * pcm_get_buffer_size().
-		 * The reason is the first pcm_get_buffer_size() will be written
-		 * to kernel buffer immediately, and the second pcm_get_buffer_size()
-		 * will be read out of queue also immediately. After the two
-		 * pcm_get_buffer_size(), kernel is consuming the data at the speed of
-		 * sampling rate.
-		 */
-		if (!epcm->tid &&
-		    pcm_bytes_to_frames(epcm->pcm, q->written) >
-		    2 * pcm_get_buffer_size(epcm->pcm)) {
-			int ret;
-			if (ret = pthread_create(&epcm->tid, NULL, pcm_streaming_thread, epcm)) {
-				KLOGE("Failed to create pcm_streaming_thread");
-				return ret;
+		int ret = 0;
+		struct backend *be = &epcm->be;
+
+		if (epcm->rs) {
+			/* The scratch buffer holds one period at the highest ratio,
+			 * so larger writes are tuned period by period.
+			 */
+			const size_t period_frames = be->config.period_size;
+			const char *src = (const char *)data;
+			size_t frames = count / epcm->frame_bytes;
+
+			while (frames && ret == 0) {
+				size_t src_frames = frames < period_frames ? frames : period_frames;
+				size_t dst_frames = epcm->rs_buf_frames;
+
+				ret = epcm_start_playback(epcm);
+				if (ret)
+					break;
+
+				/* hold the ratio until the device runs */
+				if (epcm->tid)
+					epcm_tuner_update(epcm, src_frames);
+				if (epcm->conv_buf) {
+					convert_run(&epcm->appl_conv, epcm->conv_buf, src, src_frames);
+					rs_process(epcm->rs, epcm->rs_buf, &dst_frames,
+					           epcm->conv_buf, &src_frames);
+				} else {
+					rs_process(epcm->rs, epcm->rs_buf, &dst_frames, src, &src_frames);
+				}
+				ret = queue_appl_write(q, epcm->rs_buf, dst_frames * q->frame_bytes);
+				epcm_appl_account(epcm, src_frames);
+				src += src_frames * epcm->frame_bytes;
+				frames -= src_frames;
 			}
+		} else {
+			ret = epcm_start_playback(epcm);
+			if (ret == 0)
+				ret = queue_appl_write(q, data, count);
+			if (ret == 0)
+				epcm_appl_account(epcm, count / epcm->frame_bytes);
 		}
 
-		return queue_appl_write(q, data, count);
+		return ret;
+	} else {
+		return backend_write(&epcm->be, data, count);
+	}
+}
+
+/* Ring to planar, deinterleaving while converting to the client format */
+static void epcm_planar_copy_out(const struct queue_xfer *x, void *dst,
+                                 const void *src, size_t frames)
+{
+	const struct epcm_planar *p = (const struct epcm_planar *)x->priv;
+	struct epcm *epcm = p->epcm;
+	struct converter *cv = &epcm->appl_conv;
+	size_t offset = ((const char *)dst - p->base) / p->sample_bytes;
+	const char *s = (const char *)src;
+
+	if (cv->mode == CONVERT_COPY) {
+		convert_deinterleave(p->bufs, offset, s, epcm->channels, p->sample_bytes, frames);
+		return;
+	}
+	while (frames) {
+		const size_t n = frames < EPCM_PLANAR_FRAMES ? frames : EPCM_PLANAR_FRAMES;
+
+		convert_run(cv, epcm->planar_buf, s, n);
+		convert_deinterleave(p->bufs, offset, epcm->planar_buf,
+		                     epcm->channels, p->sample_bytes, n);
+		s += n * cv->in_frame_bytes;
+		offset += n;
+		frames -= n;
+	}
+}
+
+/* Planar to ring, interleaving while converting to the ring format */
+static void epcm_planar_copy_in(const struct queue_xfer *x, void *dst,
+                                const void *src, size_t frames)
+{
+	const struct epcm_planar *p = (const struct epcm_planar *)x->priv;
+	struct epcm *epcm = p->epcm;
+	struct converter *cv = &epcm->appl_conv;
+	size_t offset = ((const char *)src - p->base) / p->sample_bytes;
+	char *d = (char *)dst;
+
+	if (cv->mode == CONVERT_COPY) {
+		convert_interleave(d, p->bufs, offset, epcm->channels, p->sample_bytes, frames);
+		return;
+	}
+	while (frames) {
+		const size_t n = frames < EPCM_PLANAR_FRAMES ? frames : EPCM_PLANAR_FRAMES;
+
+		convert_interleave(epcm->planar_buf, p->bufs, offset,
+		                   epcm->channels, p->sample_bytes, n);
+		convert_run(cv, d, epcm->planar_buf, n);
+		d += n * cv->out_frame_bytes;
+		offset += n;
+		frames -= n;
+	}
+}
+
+/* Client layout of the planar calls, the device one in bypass mode */
+static int epcm_planar_init(struct epcm *epcm, struct epcm_planar *p, void **data,
+                            unsigned int *channels, size_t *frame_bytes)
+{
+	if (epcm->callback) {
+		KLOGE("The stream is driven by its callback");
+		return -1;
+	}
+	if (epcm->q.ram_size) {
+		*channels = epcm->channels;
+		*frame_bytes = epcm->frame_bytes;
 	} else {
-		return pcm_write(epcm->pcm, data, count);
+		*channels = epcm->be.config.channels;
+		*frame_bytes = epcm->be.frame_bytes;
 	}
+	if (!epcm->planar_buf) {
+		epcm->planar_buf = (char *)malloc(EPCM_PLANAR_FRAMES * *frame_bytes);
+		if (!epcm->planar_buf) {
+			KLOGE("Failed to alloc %u bytes", EPCM_PLANAR_FRAMES * *frame_bytes);
+			return -1;
+		}
+	}
+
+	p->epcm = epcm;
+	p->bufs = data;
+	p->base = (const char *)data[0];
+	p->sample_bytes = *frame_bytes / *channels;
+
+	return 0;
+}
+
+int epcm_readn(struct epcm *epcm, void **data, unsigned int frames)
+{
+	struct queue *q = &epcm->q;
+	struct epcm_planar p;
+	unsigned int channels;
+	size_t frame_bytes;
+	size_t offset = 0;
+	int ret;
+
+	if (epcm_planar_init(epcm, &p, data, &channels, &frame_bytes) != 0)
+		return -1;
+
+	if (q->ram_size && !epcm->rs) {
+		const struct queue_xfer x = {
+			.copy = epcm_planar_copy_out,
+			.frame_bytes = p.sample_bytes,
+			.priv = &p,
+		};
+
+		ret = epcm_start_capture(epcm);
+		if (ret == 0)
+			ret = queue_appl_read_xfer(q, &x, (char *)data[0], frames * p.sample_bytes);
+		if (ret == 0)
+			epcm_appl_account(epcm, frames);
+		return ret;
+	}
+
+	/* the tuner and the device take interleaved frames */
+	while (frames) {
+		const size_t n = frames < EPCM_PLANAR_FRAMES ? frames : EPCM_PLANAR_FRAMES;
+
+		ret = epcm_read(epcm, epcm->planar_buf, n * frame_bytes);
+		if (ret != 0)
+			return ret;
+		convert_deinterleave(data, offset, epcm->planar_buf, channels, p.sample_bytes, n);
+		offset += n;
+		frames -= n;
+	}
+
+	return 0;
+}
+
+int epcm_writen(struct epcm *epcm, void **data, unsigned int frames)
+{
+	struct queue *q = &epcm->q;
+	struct epcm_planar p;
+	unsigned int channels;
+	size_t frame_bytes;
+	size_t offset = 0;
+	int ret;
+
+	if (epcm_planar_init(epcm, &p, data, &channels, &frame_bytes) != 0)
+		return -1;
+
+	if (q->ram_size && !epcm->rs) {
+		const struct queue_xfer x = {
+			.copy = epcm_planar_copy_in,
+			.frame_bytes = p.sample_bytes,
+			.priv = &p,
+		};
+
+		ret = epcm_start_playback(epcm);
+		if (ret == 0)
+			ret = queue_appl_write_xfer(q, &x, p.base, frames * p.sample_bytes);
+		if (ret == 0)
+			epcm_appl_account(epcm, frames);
+		return ret;
+	}
+
+	while (frames) {
+		const size_t n = frames < EPCM_PLANAR_FRAMES ? frames : EPCM_PLANAR_FRAMES;
+
+		convert_interleave(epcm->planar_buf, data, offset, channels, p.sample_bytes, n);
+		ret = epcm_write(epcm, epcm->planar_buf, n * frame_bytes);
+		if (ret != 0)
+			return ret;
+		offset += n;
+		frames -= n;
+	}
+
+	return 0;
 }
 
 int epcm_drain(struct epcm *epcm)
 {
 	struct queue *q = &epcm->q;
 
+	/* the callback refills the ring before every device transfer */
+	if (epcm->callback) {
+		KLOGE("The stream is driven by its callback");
+		return -1;
+	}
 	if (q->ram_size) {
-		const struct pcm_config *config = pcm_get_config(epcm->pcm);
+		const struct pcm_config *config = &epcm->be.config;
 		size_t data_size;
 
 		while ((data_size = queue_get_data_size_l(q)) > 0) {
@@ -270,6 +1019,92 @@ int epcm_drain(struct epcm *epcm)
 	return 0;
 }
 
+int epcm_set_gain(struct epcm *epcm, const float *gain, unsigned int channels,
+                  unsigned int ramp_frames)
+{
+	if (!epcm->q.ram_size || !epcm->gain_pending) {
+		KLOGE("Gain needs the extended buffer");
+		return -1;
+	}
+	if (channels != epcm->channels) {
+		KLOGE("Gain for %u channels, the stream has %u", channels, epcm->channels);
+		return -1;
+	}
+
+	pthread_mutex_lock(&epcm->gain_mutex);
+	memcpy(epcm->gain_pending, gain, sizeof(float) * channels);
+	epcm->gain_ramp_frames = ramp_frames;
+	__atomic_store_n(&epcm->gain_dirty, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&epcm->gain_mutex);
+
+	return 0;
+}
+
+int epcm_get_histogram(struct epcm *epcm, enum epcm_histogram_id id,
+                       struct epcm_histogram *hist)
+{
+	if (!epcm->hist || id < 0 || id >= EPCM_HIST_COUNT) {
+		KLOGE("No histogram %d", id);
+		return -1;
+	}
+
+	histogram_read(&epcm->hist[id], hist);
+	return 0;
+}
+
+int epcm_get_stats(struct epcm *epcm, struct epcm_stats *stats)
+{
+	const struct epcm_appl_stats *as = &epcm->appl_stats;
+	struct epcm_appl_stats appl;
+	struct queue_stats hw;
+	pthread_t tid;
+	clockid_t cid;
+	struct timespec ts;
+	unsigned int seq;
+
+	if (!epcm->q.ram_size) {
+		KLOGE("Stats need the extended buffer");
+		return -1;
+	}
+
+	queue_get_stats(&epcm->q, &hw);
+	do {
+		seq = seqlock_read_begin(&as->seq);
+		appl = *as;
+	} while (seqlock_read_retry(&as->seq, seq));
+
+	memset(stats, 0, sizeof(*stats));
+	stats->overruns = hw.overruns;
+	stats->underruns = hw.underruns;
+	stats->lost_frames = hw.lost_frames;
+	stats->device_frames = hw.hw_frames;
+	stats->client_frames = appl.frames;
+	stats->level_min = hw.level_min;
+	stats->level_max = hw.level_max;
+	if (hw.level_count)
+		stats->level_avg = (double)hw.level_sum / hw.level_count;
+	stats->tuner_ppm = appl.tuner_ppm;
+	memcpy(stats->tuner_frames, appl.tuner_frames, sizeof(stats->tuner_frames));
+
+	tid = __atomic_load_n(&epcm->tid, __ATOMIC_ACQUIRE);
+	if (tid && pthread_getcpuclockid(tid, &cid) == 0 &&
+	    clock_gettime(cid, &ts) == 0)
+		stats->thread_cpu_usecs = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+	return 0;
+}
+
+int epcm_get_trace(struct epcm *epcm, struct epcm_trace_event *events,
+                   unsigned int count)
+{
+	if (!epcm->q.trace) {
+		KLOGE("No trace");
+		return -1;
+	}
+
+	return (int)trace_read(epcm->q.trace, events, count);
+}
+
 int epcm_close(struct epcm *epcm)
 {
 	KLOGD("%s() enter", __FUNCTION__);
@@ -284,6 +1119,9 @@ int epcm_close(struct epcm *epcm)
 
 			pthread_cond_destroy(&q->cond);
 			pthread_mutex_destroy(&q->mutex_for_hw_pos);
+			pthread_mutex_destroy(&epcm->gain_mutex);
+			trace_close(q->trace);
+			q->trace = NULL;
 			free(q->ram);
 			q->ram = NULL;
 			q->ram_size = 0;
@@ -291,13 +1129,22 @@ int epcm_close(struct epcm *epcm)
 			/* bypass mode */
 		}
 
-		if (epcm->pcm) {
-			pcm_close(epcm->pcm);
-			epcm->pcm = NULL;
-		}
+		backend_close(&epcm->be);
 
 		rs_close(epcm->rs);
 		epcm->rs = NULL;
+		free(epcm->rs_buf);
+		epcm->rs_buf = NULL;
+		free(epcm->conv_buf);
+		epcm->conv_buf = NULL;
+		free(epcm->planar_buf);
+		epcm->planar_buf = NULL;
+		convert_free(&epcm->hw_conv);
+		convert_free(&epcm->appl_conv);
+		free(epcm->gain_pending);
+		epcm->gain_pending = NULL;
+		free(epcm->hist);
+		epcm->hist = NULL;
 
 		free(epcm);
 		epcm = NULL;
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "histogram.h"
+
+void histogram_read(const struct epcm_histogram *h, struct epcm_histogram *out)
+{
+	unsigned int i;
+
+	out->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	out->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+	out->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	for (i = 0; i < EPCM_HISTOGRAM_BINS; ++i)
+		out->bins[i] = __atomic_load_n(&h->bins[i], __ATOMIC_RELAXED);
+}
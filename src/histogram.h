@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+#include <easoundlib.h>
+
+/* Log2 histograms in the public layout, with a single writer,
+ * pcm_streaming_thread. Every field is stored with a relaxed atomic, so
+ * readers never take a lock and at worst see one sample partially
+ * accounted.
+ */
+
+static inline unsigned int histogram_bin(uint64_t value)
+{
+	const unsigned int bin = value ? 64 - __builtin_clzll(value) : 0;
+
+	return bin < EPCM_HISTOGRAM_BINS ? bin : EPCM_HISTOGRAM_BINS - 1;
+}
+
+static inline void histogram_add(struct epcm_histogram *h, uint64_t value)
+{
+	uint64_t *bin = &h->bins[histogram_bin(value)];
+
+	__atomic_store_n(bin, __atomic_load_n(bin, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+	if (value > h->max)
+		__atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+void histogram_read(const struct epcm_histogram *h, struct epcm_histogram *out);
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <klogging.h>
+#include "latency.h"
+
+/* The extended buffer, in device buffers, as small as epcm_open() takes */
+#define LATENCY_RING_BUFFERS 3
+
+/* Periods, and the shortest period the streaming thread is trusted to
+ * wake up for, per robustness level.
+ */
+static const struct {
+	unsigned int periods;
+	unsigned int min_period_usecs;
+	int ring;
+} levels[] = {
+	[EPCM_ROBUSTNESS_NORMAL] = { 3, 2000, 0 },
+	[EPCM_ROBUSTNESS_LOW] = { 2, 1000, 0 },
+	[EPCM_ROBUSTNESS_HIGH] = { 4, 5000, 1 },
+};
+
+static unsigned int clamp(unsigned int v, unsigned int min, unsigned int max)
+{
+	return v < min ? min : v > max ? max : v;
+}
+
+void latency_get_ranges(struct latency_ranges *r, unsigned int card, unsigned int device,
+                        unsigned int flags, int virtual_device)
+{
+	struct pcm_params *params = NULL;
+
+	r->period_min = r->periods_min = r->buffer_min = 1;
+	r->period_max = r->periods_max = r->buffer_max = UINT_MAX;
+
+	if (virtual_device)
+		return;
+	params = pcm_params_get(card, device, flags & PCM_IN);
+	if (!params) {
+		KLOGW("No hw params for card %u device %u, picking blindly", card, device);
+		return;
+	}
+	r->period_min = pcm_params_get_min(params, PCM_PARAM_PERIOD_SIZE);
+	r->period_max = pcm_params_get_max(params, PCM_PARAM_PERIOD_SIZE);
+	r->periods_min = pcm_params_get_min(params, PCM_PARAM_PERIODS);
+	r->periods_max = pcm_params_get_max(params, PCM_PARAM_PERIODS);
+	r->buffer_min = pcm_params_get_min(params, PCM_PARAM_BUFFER_SIZE);
+	r->buffer_max = pcm_params_get_max(params, PCM_PARAM_BUFFER_SIZE);
+	pcm_params_free(params);
+	KLOGD("period_size=[%u, %u] period_count=[%u, %u] buffer_size=[%u, %u]",
+	      r->period_min, r->period_max, r->periods_min, r->periods_max,
+	      r->buffer_min, r->buffer_max);
+}
+
+/* The smallest safe period is grown towards the target, which for
+ * playback also covers the extended buffer in front of the device.
+ */
+int latency_pick(const struct latency_ranges *r, enum epcm_robustness robustness,
+                 unsigned int target_millisecs, int playback,
+                 struct pcm_config *config, unsigned int *ram_millisecs)
+{
+	const uint64_t rate = config->rate;
+	unsigned int periods, period, floor, mult;
+	uint64_t target_frames, ram_frames;
+	int ring;
+
+	if (robustness < 0 || robustness > EPCM_ROBUSTNESS_HIGH || !rate) {
+		KLOGE("Invalid robustness %d or rate %u", robustness, config->rate);
+		return -1;
+	}
+
+	periods = clamp(levels[robustness].periods, r->periods_min, r->periods_max);
+	ring = levels[robustness].ring || *ram_millisecs;
+	mult = periods * (ring && playback ? 1 + LATENCY_RING_BUFFERS : 1);
+	floor = (unsigned int)((rate * levels[robustness].min_period_usecs + 999999) / 1000000);
+	target_frames = rate * target_millisecs / 1000;
+
+	period = (unsigned int)(target_frames / mult);
+	if (period < floor) {
+		KLOGI("Target latency %u ms raised to %u ms for robustness %d", target_millisecs,
+		      (unsigned int)((uint64_t)floor * mult * 1000 / rate), robustness);
+		period = floor;
+	}
+	if ((uint64_t)period * periods > r->buffer_max)
+		period = r->buffer_max / periods;
+	if ((uint64_t)period * periods < r->buffer_min)
+		period = (r->buffer_min + periods - 1) / periods;
+	period = clamp(period, r->period_min, r->period_max);
+
+	config->period_size = period;
+	config->period_count = periods;
+	if (ring) {
+		ram_frames = (uint64_t)period * periods * LATENCY_RING_BUFFERS;
+		*ram_millisecs = (unsigned int)((ram_frames * 1000 + rate - 1) / rate);
+	} else {
+		*ram_millisecs = 0;
+	}
+
+	KLOGI("period_size=%u period_count=%u ram_millisecs=%u, %u ms", period, periods,
+	      *ram_millisecs, (unsigned int)((uint64_t)period * mult * 1000 / rate));
+
+	return 0;
+}
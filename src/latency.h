@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <tinyalsa/asoundlib.h>
+#include <easoundlib.h>
+
+/* Device limits in frames, from pcm_params_get(), unbounded where unknown */
+struct latency_ranges {
+	unsigned int period_min;
+	unsigned int period_max;
+	unsigned int periods_min;
+	unsigned int periods_max;
+	unsigned int buffer_min;
+	unsigned int buffer_max;
+};
+
+void latency_get_ranges(struct latency_ranges *r, unsigned int card, unsigned int device,
+                        unsigned int flags, int virtual_device);
+
+/* Fills period_size and period_count of config, at config->rate, and the
+ * extended buffer size. ram_millisecs is non zero on input when the
+ * extended buffer is needed anyway.
+ */
+int latency_pick(const struct latency_ranges *r, enum epcm_robustness robustness,
+                 unsigned int target_millisecs, int playback,
+                 struct pcm_config *config, unsigned int *ram_millisecs);
+
+#endif
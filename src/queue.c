@@ -19,9 +19,32 @@
  */
 
 #include "queue.h"
+#include "seqlock.h"
 #include <string.h>
 #include <klogging.h>
 
+#ifdef QUEUE_LOCK_STATS
+__thread uint64_t queue_lock_wait_ns;
+__thread uint64_t queue_lock_count;
+
+static inline void queue_lock(struct queue *q)
+{
+	struct timespec t0, t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_mutex_lock(&q->mutex_for_hw_pos);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	queue_lock_wait_ns += (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000
+	                      + t1.tv_nsec - t0.tv_nsec;
+	++queue_lock_count;
+}
+#else
+static inline void queue_lock(struct queue *q)
+{
+	pthread_mutex_lock(&q->mutex_for_hw_pos);
+}
+#endif
+
 static inline size_t queue_get_appl_pos_l(struct queue *q)
 {
 	return q->appl_pos;
@@ -32,9 +55,72 @@ static inline size_t queue_get_empty_size_l(struct queue *q)
 	return q->ram_size - queue_get_data_size_l(q);
 }
 
+/* Called by the hw side with the lock held, after data_size is updated */
+static void queue_account_l(struct queue *q, size_t bytes, size_t lost_bytes)
+{
+	struct queue_stats *s = &q->stats;
+	const size_t level = queue_bytes_to_frames(q, q->data_size);
+
+	seqlock_write_begin(&s->seq);
+	if (lost_bytes) {
+		/* full after an overrun, empty after an underrun */
+		if (q->data_size)
+			++s->overruns;
+		else
+			++s->underruns;
+		s->lost_frames += queue_bytes_to_frames(q, lost_bytes);
+	}
+	s->hw_frames += queue_bytes_to_frames(q, bytes);
+	s->level = level;
+	if (!s->level_count || level < s->level_min)
+		s->level_min = level;
+	if (level > s->level_max)
+		s->level_max = level;
+	s->level_sum += level;
+	++s->level_count;
+	seqlock_write_end(&s->seq);
+}
+
+/* Ring bytes matching 'bytes' of the caller's buffer */
+static inline size_t queue_ring_bytes(const struct queue *q, const struct queue_xfer *x,
+                                      size_t bytes)
+{
+	return bytes / x->frame_bytes * q->frame_bytes;
+}
+
+static inline const char *queue_copy_in(struct queue *q, const struct queue_xfer *x,
+                                        char *ring, const char *buf, size_t ring_bytes)
+{
+	const size_t frames = ring_bytes / q->frame_bytes;
+
+	if (x->copy)
+		x->copy(x, ring, buf, frames);
+	else
+		memcpy(ring, buf, ring_bytes);
+
+	return buf + frames * x->frame_bytes;
+}
+
+static inline char *queue_copy_out(struct queue *q, const struct queue_xfer *x,
+                                   char *buf, const char *ring, size_t ring_bytes)
+{
+	const size_t frames = ring_bytes / q->frame_bytes;
+
+	if (x->copy)
+		x->copy(x, buf, ring, frames);
+	else
+		memcpy(buf, ring, ring_bytes);
+
+	return buf + frames * x->frame_bytes;
+}
+
 int queue_hw_write(struct queue *q, const char *buf, size_t bytes)
 {
-	pthread_mutex_lock(&q->mutex_for_hw_pos);
+	const struct queue_xfer *x = &q->hw_xfer;
+
+	bytes = queue_ring_bytes(q, x, bytes);
+
+	queue_lock(q);
 
 	size_t w = q->hw_pos;
 	const char *p = buf;
@@ -42,18 +128,19 @@ int queue_hw_write(struct queue *q, const char *buf, size_t bytes)
 	while (size) {
 		size_t bytes_to_end = q->ram_size - w;
 		if (size < bytes_to_end) {
-			memcpy(q->ram + w, p, size);
+			p = queue_copy_in(q, x, q->ram + w, p, size);
 			w += size;
 			size = 0;
 		} else {
-			memcpy(q->ram + w, p, bytes_to_end);
-			p += bytes_to_end;
+			p = queue_copy_in(q, x, q->ram + w, p, bytes_to_end);
 			w = 0;
 			size -= bytes_to_end;
 		}
 	}
 
+	size_t lost = 0;
 	if (q->data_size + bytes > q->ram_size) {
+		lost = q->data_size + bytes - q->ram_size;
 		q->appl_pos = w;
 		q->data_size = q->ram_size;
 		q->xrun = 1;
@@ -61,9 +148,14 @@ int queue_hw_write(struct queue *q, const char *buf, size_t bytes)
 		q->data_size += bytes;
 	}
 	q->hw_pos = w;
-	KLOGV("queue:  +%7u bytes  [%10u / %10u] %3u%% %s",
-	      bytes, q->data_size, q->ram_size, q->data_size * 100 / q->ram_size,
-	      q->xrun ? "overrun" : "");
+	queue_account_l(q, bytes, lost);
+	clock_gettime(CLOCK_MONOTONIC, &q->hw_tstamp);
+	if (lost)
+		trace_add(q->trace, EPCM_TRACE_OVERRUN, queue_bytes_to_frames(q, q->data_size), lost);
+	trace_add(q->trace, EPCM_TRACE_HW_WRITE, queue_bytes_to_frames(q, q->data_size), bytes);
+	HOT_KLOGV("queue:  +%7u bytes  [%10u / %10u] %3u%% %s",
+	          bytes, q->data_size, q->ram_size, q->data_size * 100 / q->ram_size,
+	          q->xrun ? "overrun" : "");
 
 	pthread_cond_signal(&q->cond);
 	pthread_mutex_unlock(&q->mutex_for_hw_pos);
@@ -73,12 +165,21 @@ int queue_hw_write(struct queue *q, const char *buf, size_t bytes)
 
 int queue_appl_read(struct queue *q, char *buf, size_t bytes)
 {
-	size_t size = bytes;
+	return queue_appl_read_xfer(q, &q->appl_xfer, buf, bytes);
+}
+
+int queue_appl_read_xfer(struct queue *q, const struct queue_xfer *x,
+                         char *buf, size_t bytes)
+{
+	size_t size;
+
+	bytes = queue_ring_bytes(q, x, bytes);
+	size = bytes;
 	size_t avail = 0;
 	size_t appl_pos = 0;
 
 	while (size) {
-		pthread_mutex_lock(&q->mutex_for_hw_pos);
+		queue_lock(q);
 		while ((avail = queue_get_data_size_l(q)) == 0) {
 			pthread_cond_wait(&q->cond, &q->mutex_for_hw_pos);
 		}
@@ -90,20 +191,18 @@ int queue_appl_read(struct queue *q, char *buf, size_t bytes)
 		while (left) {
 			size_t bytes_to_end = q->ram_size - appl_pos;
 			if (left < bytes_to_end) {
-				memcpy(buf, q->ram + appl_pos, left);
-				buf += left;
+				buf = queue_copy_out(q, x, buf, q->ram + appl_pos, left);
 				appl_pos += left;
 				left = 0;
 			} else {
-				memcpy(buf, q->ram + appl_pos, bytes_to_end);
-				buf += bytes_to_end;
+				buf = queue_copy_out(q, x, buf, q->ram + appl_pos, bytes_to_end);
 				appl_pos = 0;
 				left -= bytes_to_end;
 			}
 		}
 		size -= actual_read;
 
-		pthread_mutex_lock(&q->mutex_for_hw_pos);
+		queue_lock(q);
 		if (q->xrun) {
 			/* Now, q->appl_pos == q->hw_pos,
 			 * q->data_size == q->ram_size
@@ -115,9 +214,11 @@ int queue_appl_read(struct queue *q, char *buf, size_t bytes)
 			q->appl_pos = appl_pos;
 			q->data_size -= actual_read;
 		}
-		KLOGV("queue:  -%7u bytes  [%10u / %10u] %3u%% %s",
-		      bytes, q->data_size, q->ram_size, q->data_size * 100 / q->ram_size,
-		      q->xrun ? "overrun" : "");
+		trace_add(q->trace, EPCM_TRACE_APPL_READ,
+		          queue_bytes_to_frames(q, q->data_size), actual_read);
+		HOT_KLOGV("queue:  -%7u bytes  [%10u / %10u] %3u%% %s",
+		          bytes, q->data_size, q->ram_size, q->data_size * 100 / q->ram_size,
+		          q->xrun ? "overrun" : "");
 		pthread_mutex_unlock(&q->mutex_for_hw_pos);
 	}
 
@@ -126,12 +227,21 @@ int queue_appl_read(struct queue *q, char *buf, size_t bytes)
 
 int queue_appl_write(struct queue *q, const char *buf, size_t bytes)
 {
-	size_t size = bytes;
+	return queue_appl_write_xfer(q, &q->appl_xfer, buf, bytes);
+}
+
+int queue_appl_write_xfer(struct queue *q, const struct queue_xfer *x,
+                          const char *buf, size_t bytes)
+{
+	size_t size;
+
+	bytes = queue_ring_bytes(q, x, bytes);
+	size = bytes;
 	size_t empty = 0;
 	size_t appl_pos = 0;
 
 	while (size) {
-		pthread_mutex_lock(&q->mutex_for_hw_pos);
+		queue_lock(q);
 		while ((empty = queue_get_empty_size_l(q)) == 0) {
 			pthread_cond_wait(&q->cond, &q->mutex_for_hw_pos);
 		}
@@ -143,20 +253,18 @@ int queue_appl_write(struct queue *q, const char *buf, size_t bytes)
 		while (left) {
 			size_t bytes_to_end = q->ram_size - appl_pos;
 			if (left < bytes_to_end) {
-				memcpy(q->ram + appl_pos, buf, left);
-				buf += left;
+				buf = queue_copy_in(q, x, q->ram + appl_pos, buf, left);
 				appl_pos += left;
 				left = 0;
 			} else {
-				memcpy(q->ram + appl_pos, buf, bytes_to_end);
-				buf += bytes_to_end;
+				buf = queue_copy_in(q, x, q->ram + appl_pos, buf, bytes_to_end);
 				appl_pos = 0;
 				left -= bytes_to_end;
 			}
 		}
 		size -= actual_write;
 
-		pthread_mutex_lock(&q->mutex_for_hw_pos);
+		queue_lock(q);
 		if (q->xrun) {
 			/* now, q->appl_pos == q->hw_pos,
 			 * q->data_size == 0
@@ -169,8 +277,10 @@ int queue_appl_write(struct queue *q, const char *buf, size_t bytes)
 			q->appl_pos = appl_pos;
 			q->data_size += actual_write;
 		}
-		KLOGV("queue:  +%7u bytes  [%10u / %10u] %3u%%",
-		      bytes, q->data_size, q->ram_size, q->data_size * 100 / q->ram_size);
+		trace_add(q->trace, EPCM_TRACE_APPL_WRITE,
+		          queue_bytes_to_frames(q, q->data_size), actual_write);
+		HOT_KLOGV("queue:  +%7u bytes  [%10u / %10u] %3u%%",
+		          bytes, q->data_size, q->ram_size, q->data_size * 100 / q->ram_size);
 		pthread_mutex_unlock(&q->mutex_for_hw_pos);
 	}
 
@@ -181,25 +291,30 @@ int queue_appl_write(struct queue *q, const char *buf, size_t bytes)
 
 int queue_hw_read(struct queue *q, char *buf, size_t bytes)
 {
-	pthread_mutex_lock(&q->mutex_for_hw_pos);
+	const struct queue_xfer *x = &q->hw_xfer;
+
+	bytes = queue_ring_bytes(q, x, bytes);
+
+	queue_lock(q);
 
 	size_t r = q->hw_pos;
 	size_t size = bytes;
 	while (size) {
 		size_t bytes_to_end = q->ram_size - r;
 		if (size < bytes_to_end) {
-			memcpy(buf, q->ram + r, size);
+			buf = queue_copy_out(q, x, buf, q->ram + r, size);
 			r += size;
 			size = 0;
 		} else {
-			memcpy(buf, q->ram + r, bytes_to_end);
-			buf += bytes_to_end;
+			buf = queue_copy_out(q, x, buf, q->ram + r, bytes_to_end);
 			r = 0;
 			size -= bytes_to_end;
 		}
 	}
 
+	size_t lost = 0;
 	if (q->data_size < bytes) {
+		lost = bytes - q->data_size;
 		q->appl_pos = r;
 		q->data_size = 0;
 		q->xrun = 1;
@@ -207,12 +322,109 @@ int queue_hw_read(struct queue *q, char *buf, size_t bytes)
 		q->data_size -= bytes;
 	}
 	q->hw_pos = r;
-	KLOGV("queue:  -%7u bytes  [%10u / %10u] %3u%% %s",
-	      bytes, q->data_size, q->ram_size, q->data_size * 100 / q->ram_size,
-	      q->xrun ? "underrun" : "");
+	queue_account_l(q, bytes, lost);
+	clock_gettime(CLOCK_MONOTONIC, &q->hw_tstamp);
+	if (lost)
+		trace_add(q->trace, EPCM_TRACE_UNDERRUN, queue_bytes_to_frames(q, q->data_size), lost);
+	trace_add(q->trace, EPCM_TRACE_HW_READ, queue_bytes_to_frames(q, q->data_size), bytes);
+	HOT_KLOGV("queue:  -%7u bytes  [%10u / %10u] %3u%% %s",
+	          bytes, q->data_size, q->ram_size, q->data_size * 100 / q->ram_size,
+	          q->xrun ? "underrun" : "");
 
 	pthread_cond_signal(&q->cond);
 	pthread_mutex_unlock(&q->mutex_for_hw_pos);
 
 	return 0;
 }
+
+char *queue_appl_write_begin(struct queue *q, size_t *bytes)
+{
+	size_t empty, to_end;
+
+	queue_lock(q);
+	empty = queue_get_empty_size_l(q);
+	to_end = q->ram_size - q->appl_pos;
+	*bytes = empty < to_end ? empty : to_end;
+	pthread_mutex_unlock(&q->mutex_for_hw_pos);
+
+	return q->ram + q->appl_pos;
+}
+
+void queue_appl_write_commit(struct queue *q, size_t bytes)
+{
+	queue_lock(q);
+	q->xrun = 0;
+	q->appl_pos = (q->appl_pos + bytes) % q->ram_size;
+	q->data_size += bytes;
+	trace_add(q->trace, EPCM_TRACE_APPL_WRITE,
+	          queue_bytes_to_frames(q, q->data_size), bytes);
+	pthread_mutex_unlock(&q->mutex_for_hw_pos);
+
+	q->written += bytes;
+}
+
+char *queue_appl_read_begin(struct queue *q, size_t *bytes)
+{
+	size_t avail, to_end;
+
+	queue_lock(q);
+	avail = queue_get_data_size_l(q);
+	to_end = q->ram_size - q->appl_pos;
+	*bytes = avail < to_end ? avail : to_end;
+	pthread_mutex_unlock(&q->mutex_for_hw_pos);
+
+	return q->ram + q->appl_pos;
+}
+
+void queue_appl_read_commit(struct queue *q, size_t bytes)
+{
+	queue_lock(q);
+	q->xrun = 0;
+	q->appl_pos = (q->appl_pos + bytes) % q->ram_size;
+	q->data_size -= bytes;
+	trace_add(q->trace, EPCM_TRACE_APPL_READ,
+	          queue_bytes_to_frames(q, q->data_size), bytes);
+	pthread_mutex_unlock(&q->mutex_for_hw_pos);
+}
+
+void queue_get_stats(const struct queue *q, struct queue_stats *stats)
+{
+	unsigned int seq;
+
+	do {
+		seq = seqlock_read_begin(&q->stats.seq);
+		*stats = q->stats;
+	} while (seqlock_read_retry(&q->stats.seq, seq));
+}
+
+/* Returns the data size together with the time elapsed since the last
+ * hw side transfer, which lets the caller interpolate the level of the
+ * device in between the buffer sized steps.
+ */
+size_t queue_get_data_size_since_hw(struct queue *q, uint64_t *usecs)
+{
+	struct timespec now;
+	size_t data_size;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	queue_lock(q);
+	data_size = queue_get_data_size_l(q);
+	if (q->hw_tstamp.tv_sec || q->hw_tstamp.tv_nsec)
+		*usecs = (uint64_t)(now.tv_sec - q->hw_tstamp.tv_sec) * 1000000
+		         + (now.tv_nsec - q->hw_tstamp.tv_nsec) / 1000;
+	else
+		*usecs = 0;
+	pthread_mutex_unlock(&q->mutex_for_hw_pos);
+
+	return data_size;
+}
+
+void queue_wait_data_size(struct queue *q, size_t bytes)
+{
+	queue_lock(q);
+	while (queue_get_data_size_l(q) < bytes) {
+		pthread_cond_wait(&q->cond, &q->mutex_for_hw_pos);
+	}
+	pthread_mutex_unlock(&q->mutex_for_hw_pos);
+}
@@ -23,6 +23,33 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <time.h>
+#include "trace.h"
+
+/* Copies frames between a caller side buffer and the ring, converting
+ * them on the way. The byte counts given to the queue functions are in
+ * units of the caller's frame_bytes, the ring uses queue.frame_bytes.
+ * A NULL copy is a plain memcpy between equally sized frames.
+ */
+struct queue_xfer {
+	void (*copy)(const struct queue_xfer *x, void *dst, const void *src, size_t frames);
+	size_t frame_bytes;
+	void *priv;
+};
+
+/* Kept by the hw side, read without the lock through seq */
+struct queue_stats {
+	unsigned int seq;
+	uint64_t overruns;
+	uint64_t underruns;
+	uint64_t lost_frames;
+	uint64_t hw_frames;
+	size_t level;		/* frames, after the last hw side transfer */
+	size_t level_min;
+	size_t level_max;
+	uint64_t level_sum;
+	uint64_t level_count;
+};
 
 struct queue {
 	char *ram;
@@ -34,18 +61,53 @@ struct queue {
 	pthread_mutex_t mutex_for_hw_pos;
 	pthread_cond_t cond;
 	uint64_t written;
+	struct timespec hw_tstamp;	/* time of the last hw side transfer */
+	size_t frame_bytes;		/* ring frame size */
+	struct queue_xfer hw_xfer;	/* pcm_streaming_thread side */
+	struct queue_xfer appl_xfer;	/* epcm_read() / epcm_write() side */
+	struct queue_stats stats;
+	struct trace *trace;		/* NULL unless tracing */
 };
 
+#ifdef QUEUE_LOCK_STATS
+/* time spent waiting for mutex_for_hw_pos, per thread, for queue_bench */
+extern __thread uint64_t queue_lock_wait_ns;
+extern __thread uint64_t queue_lock_count;
+#endif
+
 /* playback */
 int queue_appl_write(struct queue *q, const char *buf, size_t bytes);
+/* Same, through another transfer than appl_xfer, e.g. planar buffers */
+int queue_appl_write_xfer(struct queue *q, const struct queue_xfer *x,
+                          const char *buf, size_t bytes);
 int queue_hw_read(struct queue *q, char *buf, size_t bytes);
 static inline size_t queue_get_data_size_l(struct queue *q)
 {
 	return q->data_size;
 }
+static inline size_t queue_bytes_to_frames(const struct queue *q, size_t bytes)
+{
+	return bytes / q->frame_bytes;
+}
+
+void queue_get_stats(const struct queue *q, struct queue_stats *stats);
+
+/* In place access at appl_pos, for callbacks run by the hw side thread
+ * itself: the contiguous empty (playback) or filled (capture) bytes,
+ * then committed once used.
+ */
+char *queue_appl_write_begin(struct queue *q, size_t *bytes);
+void queue_appl_write_commit(struct queue *q, size_t bytes);
+char *queue_appl_read_begin(struct queue *q, size_t *bytes);
+void queue_appl_read_commit(struct queue *q, size_t bytes);
+
+size_t queue_get_data_size_since_hw(struct queue *q, uint64_t *usecs);
+void queue_wait_data_size(struct queue *q, size_t bytes);
 
 /* capture */
 int queue_appl_read(struct queue *q, char *buf, size_t bytes);
+int queue_appl_read_xfer(struct queue *q, const struct queue_xfer *x,
+                         char *buf, size_t bytes);
 int queue_hw_write(struct queue *q, const char *buf, size_t bytes);
 
 #endif
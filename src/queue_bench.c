@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Throughput and contention of the extended buffer queue.
+ *
+ * An application thread and a hardware thread move data through one
+ * queue, the way epcm_write()/pcm_streaming_thread and
+ * pcm_streaming_thread/epcm_read() do. The hardware side never blocks in
+ * the queue, so here it polls for room or data instead of being paced by
+ * a device. Each case sweeps the ring size, the application chunk and
+ * the CPU placement of the two threads, and reports:
+ *   GB/s     payload moved per second
+ *   wakeups  voluntary context switches of both threads per second
+ *   lock     mean wait for mutex_for_hw_pos per acquisition, app / hw
+ *   p50..max duration of the application side queue calls
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "queue.h"
+
+#define FRAME_BYTES	4
+#define TOTAL_BYTES	((size_t)256 << 20)
+#define HW_CHUNK_MAX	16384
+#define MAX_SAMPLES	(1 << 20)
+
+enum pinning {
+	PIN_NONE,
+	PIN_SAME,	/* both threads on CPU 0 */
+	PIN_SPLIT,	/* CPU 0 and CPU 1 */
+};
+
+static const char *pinning_names[] = { "none", "same", "split" };
+static const size_t ring_sizes[] = { 64 << 10, 1 << 20, 16 << 20 };
+static const size_t appl_chunks[] = { 256, 4096, 65536 };
+
+struct bench {
+	struct queue q;
+	int capture;
+	enum pinning pinning;
+	size_t appl_chunk;
+	size_t hw_chunk;
+	char *appl_buf;
+	char *hw_buf;
+
+	/* results */
+	uint64_t *samples;	/* application call durations, ns */
+	size_t nsamples;
+	uint64_t lock_ns[2];	/* app, hw */
+	uint64_t locks[2];
+	long switches[2];
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void pin(enum pinning pinning, int cpu)
+{
+	cpu_set_t set;
+
+	if (pinning == PIN_NONE)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(pinning == PIN_SAME ? 0 : cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static long voluntary_switches(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	return ru.ru_nvcsw;
+}
+
+static void *appl_thread(void *data)
+{
+	struct bench *b = (struct bench *)data;
+	const long switches = voluntary_switches();
+	size_t done;
+
+	pin(b->pinning, 0);
+	queue_lock_wait_ns = 0;
+	queue_lock_count = 0;
+
+	for (done = 0; done < TOTAL_BYTES; done += b->appl_chunk) {
+		const uint64_t t = now_ns();
+
+		if (b->capture)
+			queue_appl_read(&b->q, b->appl_buf, b->appl_chunk);
+		else
+			queue_appl_write(&b->q, b->appl_buf, b->appl_chunk);
+		if (b->nsamples < MAX_SAMPLES)
+			b->samples[b->nsamples++] = now_ns() - t;
+	}
+
+	b->lock_ns[0] = queue_lock_wait_ns;
+	b->locks[0] = queue_lock_count;
+	b->switches[0] = voluntary_switches() - switches;
+	return NULL;
+}
+
+/* Waits for a whole chunk of data (playback) or room (capture) */
+static void hw_wait(struct bench *b)
+{
+	struct queue *q = &b->q;
+
+	for (;;) {
+		size_t size;
+
+		pthread_mutex_lock(&q->mutex_for_hw_pos);
+		size = b->capture ? q->ram_size - q->data_size : q->data_size;
+		pthread_mutex_unlock(&q->mutex_for_hw_pos);
+		if (size >= b->hw_chunk)
+			return;
+		sched_yield();
+	}
+}
+
+static void *hw_thread(void *data)
+{
+	struct bench *b = (struct bench *)data;
+	const long switches = voluntary_switches();
+	size_t done;
+
+	pin(b->pinning, 1);
+	queue_lock_wait_ns = 0;
+	queue_lock_count = 0;
+
+	for (done = 0; done < TOTAL_BYTES; done += b->hw_chunk) {
+		hw_wait(b);
+		if (b->capture)
+			queue_hw_write(&b->q, b->hw_buf, b->hw_chunk);
+		else
+			queue_hw_read(&b->q, b->hw_buf, b->hw_chunk);
+	}
+
+	b->lock_ns[1] = queue_lock_wait_ns;
+	b->locks[1] = queue_lock_count;
+	b->switches[1] = voluntary_switches() - switches;
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const struct bench *b, double p)
+{
+	return b->samples[(size_t)((b->nsamples - 1) * p)] / 1000.0;
+}
+
+static int run(int capture, size_t ring_size, size_t appl_chunk, enum pinning pinning)
+{
+	struct bench b;
+	struct queue *q = &b.q;
+	pthread_t appl, hw;
+	double secs;
+	uint64_t t;
+	int ret = -1;
+
+	memset(&b, 0, sizeof(b));
+	b.capture = capture;
+	b.pinning = pinning;
+	b.appl_chunk = appl_chunk;
+	b.hw_chunk = ring_size / 4 < HW_CHUNK_MAX ? ring_size / 4 : HW_CHUNK_MAX;
+	b.appl_buf = (char *)calloc(1, appl_chunk);
+	b.hw_buf = (char *)calloc(1, b.hw_chunk);
+	b.samples = (uint64_t *)malloc(sizeof(uint64_t) * MAX_SAMPLES);
+
+	q->ram = (char *)calloc(1, ring_size);
+	q->ram_size = ring_size;
+	q->frame_bytes = FRAME_BYTES;
+	q->hw_xfer.frame_bytes = FRAME_BYTES;
+	q->appl_xfer.frame_bytes = FRAME_BYTES;
+	pthread_mutex_init(&q->mutex_for_hw_pos, (const pthread_mutexattr_t *)NULL);
+	pthread_cond_init(&q->cond, (const pthread_condattr_t *)NULL);
+
+	if (!b.appl_buf || !b.hw_buf || !b.samples || !q->ram)
+		goto error;
+
+	t = now_ns();
+	pthread_create(&appl, NULL, appl_thread, &b);
+	pthread_create(&hw, NULL, hw_thread, &b);
+	pthread_join(appl, NULL);
+	pthread_join(hw, NULL);
+	secs = (now_ns() - t) * 1e-9;
+
+	qsort(b.samples, b.nsamples, sizeof(uint64_t), compare_u64);
+	printf("%-8s ring %6zuK chunk %6zu pin %-5s | %6.2f GB/s %9.0f wakeups/s"
+	       " | lock %6.0f / %6.0f ns | p50 %7.2f p99 %8.2f p99.9 %8.2f max %9.2f us\n",
+	       capture ? "capture" : "playback", ring_size >> 10, appl_chunk,
+	       pinning_names[pinning], TOTAL_BYTES / secs * 1e-9,
+	       (b.switches[0] + b.switches[1]) / secs,
+	       b.locks[0] ? (double)b.lock_ns[0] / b.locks[0] : 0.0,
+	       b.locks[1] ? (double)b.lock_ns[1] / b.locks[1] : 0.0,
+	       percentile(&b, 0.5), percentile(&b, 0.99), percentile(&b, 0.999),
+	       percentile(&b, 1.0));
+	ret = 0;
+
+error:
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->mutex_for_hw_pos);
+	free(q->ram);
+	free(b.appl_buf);
+	free(b.hw_buf);
+	free(b.samples);
+	return ret;
+}
+
+int main(void)
+{
+	const int split = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+	int capture, pinning;
+	size_t r, c;
+	int ret = EXIT_SUCCESS;
+
+	for (capture = 0; capture < 2; ++capture)
+		for (r = 0; r < sizeof(ring_sizes) / sizeof(ring_sizes[0]); ++r)
+			for (c = 0; c < sizeof(appl_chunks) / sizeof(appl_chunks[0]); ++c)
+				for (pinning = PIN_NONE; pinning <= PIN_SPLIT; ++pinning) {
+					if (appl_chunks[c] > ring_sizes[r])
+						continue;
+					if (pinning == PIN_SPLIT && !split)
+						continue;
+					if (run(capture, ring_sizes[r], appl_chunks[c],
+					        (enum pinning)pinning) != 0)
+						ret = EXIT_FAILURE;
+				}
+
+	return ret;
+}
@@ -18,126 +18,230 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
-#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include "resampler.h"
 
-#define LINEAR_DIV_SHIFT 19
-#define LINEAR_DIV (1<<LINEAR_DIV_SHIFT)
-#define MAX_CHNUM  (8)
+/* The read position is kept in 32.32 fixed point, in input frames */
+#define PHASE_SHIFT 32
+#define PHASE_ONE   ((uint64_t)1 << PHASE_SHIFT)
+
+typedef void (*rs_kernel)(struct resampler *rs, void *dst, size_t *dst_frames,
+                          const void *src, size_t *src_frames);
 
 struct resampler {
 	size_t chnum;
+	enum rs_format format;
 	size_t in_rate;
 	size_t out_rate;
-	void (*process_s16)(struct resampler *rs, int16_t *dst, size_t dst_frames,
-	                    const int16_t *src, size_t src_frames);
+	rs_kernel process;
+
+	/* input frames advanced per output frame */
+	uint64_t step;
+	/* position of the next output frame after old_frame; at least
+	 * PHASE_ONE means that input frames have to be consumed first
+	 */
+	uint64_t phase;
 
-	int16_t old_sample[MAX_CHNUM];
-	unsigned int pitch;
-	unsigned int pitch_shift;
+	/* The two input frames around the read position, carried over
+	 * from call to call and allocated together with the struct so
+	 * that the frame-major loops below walk them sequentially
+	 * whatever the channel count is. Sized for either format.
+	 */
+	void *old_frame;
+	void *new_frame;
+	float frames[];
 };
 
-static void upsample_s16(struct resampler *rs, int16_t *dst, size_t dst_frames,
-                         const int16_t *src, size_t src_frames)
+static inline void interpolate_s16(int16_t *q, const int16_t *old_frame,
+                                   const int16_t *new_frame, size_t chnum,
+                                   uint64_t phase)
 {
+	const int new_weight = (int)(phase >> (PHASE_SHIFT - 16));
+	const int old_weight = 0x10000 - new_weight;
 	size_t ch;
 
-	for (ch = 0; ch < rs->chnum; ++ch) {
-		int16_t old_sample = 0;
-		int16_t new_sample = rs->old_sample[ch];
-		size_t j = 0;
-		size_t i = 0;
-		size_t pos = rs->pitch;
-		const int16_t *p = src + ch;
-		int16_t *q = dst + ch;
-		while (j < dst_frames) {
-			int old_weight, new_weight;
-			if (pos >= rs->pitch) {
-				pos -= rs->pitch;
-				old_sample = new_sample;
-				if (i < src_frames)
-					new_sample = *p;
-			}
-			new_weight = (pos << (16 - rs->pitch_shift)) / (rs->pitch >> rs->pitch_shift);
-			old_weight = 0x10000 - new_weight;
-			*q = (old_sample * old_weight + new_sample * new_weight) >> 16;
-			q += rs->chnum;
-			++j;
-			pos += LINEAR_DIV;
-			if (pos >= rs->pitch) {
-				p += rs->chnum;
-				++i;
-			}
-		}
-		rs->old_sample[ch] = new_sample;
-	}
+	for (ch = 0; ch < chnum; ++ch)
+		q[ch] = (old_frame[ch] * old_weight + new_frame[ch] * new_weight) >> 16;
 }
 
-static void downsample_s16(struct resampler *rs, int16_t *dst, size_t dst_frames,
-                           const int16_t *src, size_t src_frames)
+static inline void interpolate_float(float *q, const float *old_frame,
+                                     const float *new_frame, size_t chnum,
+                                     uint64_t phase)
 {
+	const float new_weight = (uint32_t)phase * (1.0f / PHASE_ONE);
 	size_t ch;
 
-	for (ch = 0; ch < rs->chnum; ++ch) {
-		const int16_t *p = src + ch;
-		int16_t *q = dst + ch;
-		int16_t old_sample = 0;
-		int16_t new_sample = 0;
-		unsigned int pos = LINEAR_DIV - rs->pitch;
-		size_t i = 0;
-		size_t j = 0;
-		while (i < src_frames) {
-			new_sample = *p;
-			p += rs->chnum;
-			++i;
-			pos += rs->pitch;
-			if (pos >= LINEAR_DIV) {
-				int old_weight, new_weight;
-				pos -= LINEAR_DIV;
-				old_weight = (pos << (32 - LINEAR_DIV_SHIFT)) / (rs->pitch >> (LINEAR_DIV_SHIFT - 16));
-				new_weight = 0x10000 - old_weight;
-				*q = (old_sample * old_weight + new_sample * new_weight) >> 16;
-				q += rs->chnum;
-				++j;
-				if (j > dst_frames) {
-					printf("dst_frames overflow\n");
-					break;
-				}
-			}
-			old_sample = new_sample;
-		}
-	}
+	for (ch = 0; ch < chnum; ++ch)
+		q[ch] = old_frame[ch] + (new_frame[ch] - old_frame[ch]) * new_weight;
+}
+
+/* The kernels below take the channel count as an expression: a constant
+ * for the common layouts, so that the frame copies and the interpolation
+ * loops get fixed strides and are unrolled, or rs->chnum otherwise.
+ */
+
+/* At most one input frame is consumed per output frame */
+#define DEFINE_UPSAMPLE(name, type, interpolate, CHNUM)				\
+static void name(struct resampler *rs, void *dst, size_t *dst_frames,			\
+                 const void *src, size_t *src_frames)					\
+{											\
+	const size_t chnum = (CHNUM);							\
+	type *old_frame = (type *)rs->old_frame;					\
+	type *new_frame = (type *)rs->new_frame;					\
+	const type *p = (const type *)src;						\
+	type *q = (type *)dst;								\
+	uint64_t phase = rs->phase;							\
+	size_t i = 0;									\
+	size_t j = 0;									\
+											\
+	while (j < *dst_frames) {							\
+		while (phase >= PHASE_ONE) {						\
+			if (i == *src_frames)						\
+				goto out;						\
+			memcpy(old_frame, new_frame, chnum * sizeof(type));		\
+			memcpy(new_frame, p + i * chnum, chnum * sizeof(type));		\
+			++i;								\
+			phase -= PHASE_ONE;						\
+		}									\
+		interpolate(q + j * chnum, old_frame, new_frame, chnum, phase);		\
+		++j;									\
+		phase += rs->step;							\
+	}										\
+											\
+out:											\
+	rs->phase = phase;								\
+	*src_frames = i;								\
+	*dst_frames = j;								\
+}
+
+/* Input frames in between two output frames are skipped over */
+#define DEFINE_DOWNSAMPLE(name, type, interpolate, CHNUM)				\
+static void name(struct resampler *rs, void *dst, size_t *dst_frames,			\
+                 const void *src, size_t *src_frames)					\
+{											\
+	const size_t chnum = (CHNUM);							\
+	type *old_frame = (type *)rs->old_frame;					\
+	type *new_frame = (type *)rs->new_frame;					\
+	const type *p = (const type *)src;						\
+	type *q = (type *)dst;								\
+	uint64_t phase = rs->phase;							\
+	size_t i = 0;									\
+	size_t j = 0;									\
+											\
+	while (j < *dst_frames) {							\
+		if (phase >= PHASE_ONE) {						\
+			size_t n = phase >> PHASE_SHIFT;				\
+			if (n > *src_frames - i)					\
+				n = *src_frames - i;					\
+			if (n == 0)							\
+				break;							\
+			if (n == 1)							\
+				memcpy(old_frame, new_frame, chnum * sizeof(type));	\
+			else								\
+				memcpy(old_frame, p + (i + n - 2) * chnum,		\
+				       chnum * sizeof(type));				\
+			memcpy(new_frame, p + (i + n - 1) * chnum, chnum * sizeof(type)); \
+			i += n;								\
+			phase -= (uint64_t)n << PHASE_SHIFT;				\
+			if (phase >= PHASE_ONE)						\
+				break;							\
+		}									\
+		interpolate(q + j * chnum, old_frame, new_frame, chnum, phase);		\
+		++j;									\
+		phase += rs->step;							\
+	}										\
+											\
+	rs->phase = phase;								\
+	*src_frames = i;								\
+	*dst_frames = j;								\
+}
+
+#define DEFINE_KERNELS(ch)								\
+	DEFINE_UPSAMPLE(upsample_s16_##ch, int16_t, interpolate_s16, ch)		\
+	DEFINE_DOWNSAMPLE(downsample_s16_##ch, int16_t, interpolate_s16, ch)		\
+	DEFINE_UPSAMPLE(upsample_float_##ch, float, interpolate_float, ch)		\
+	DEFINE_DOWNSAMPLE(downsample_float_##ch, float, interpolate_float, ch)
+
+DEFINE_KERNELS(1)
+DEFINE_KERNELS(2)
+DEFINE_KERNELS(4)
+DEFINE_KERNELS(6)
+DEFINE_KERNELS(8)
+
+DEFINE_UPSAMPLE(upsample_s16, int16_t, interpolate_s16, rs->chnum)
+DEFINE_DOWNSAMPLE(downsample_s16, int16_t, interpolate_s16, rs->chnum)
+DEFINE_UPSAMPLE(upsample_float, float, interpolate_float, rs->chnum)
+DEFINE_DOWNSAMPLE(downsample_float, float, interpolate_float, rs->chnum)
+
+struct rs_kernels {
+	size_t chnum;
+	rs_kernel upsample_s16;
+	rs_kernel downsample_s16;
+	rs_kernel upsample_float;
+	rs_kernel downsample_float;
+};
+
+#define RS_KERNELS(ch) \
+	{ ch, upsample_s16_##ch, downsample_s16_##ch, upsample_float_##ch, downsample_float_##ch }
+
+static const struct rs_kernels kernels[] = {
+	RS_KERNELS(1),
+	RS_KERNELS(2),
+	RS_KERNELS(4),
+	RS_KERNELS(6),
+	RS_KERNELS(8),
+	/* any other channel count */
+	{ 0, upsample_s16, downsample_s16, upsample_float, downsample_float },
+};
+
+static const struct rs_kernels *rs_get_kernels(size_t chnum)
+{
+	const struct rs_kernels *k = kernels;
+
+	while (k->chnum && k->chnum != chnum)
+		++k;
+	return k;
 }
 
 int rs_adjust(struct resampler *rs, size_t out_rate, size_t in_rate)
 {
-	rs->pitch = (((uint64_t)out_rate * LINEAR_DIV) + (in_rate / 2)) / in_rate;
+	const int up = in_rate < out_rate;
+	const struct rs_kernels *k = rs_get_kernels(rs->chnum);
 
-	if (rs->pitch >= LINEAR_DIV) {
-		rs->pitch_shift = 0;
-		while ((rs->pitch >> rs->pitch_shift) >= (1 << 16))
-			++rs->pitch_shift;
-	}
+	if (!out_rate || !in_rate)
+		return -1;
 
+	rs->step = (((uint64_t)in_rate << PHASE_SHIFT) + (out_rate / 2)) / out_rate;
 	rs->in_rate = in_rate;
 	rs->out_rate = out_rate;
-	rs->process_s16 = (in_rate < out_rate) ? upsample_s16 : downsample_s16;
+	if (rs->format == RS_FORMAT_FLOAT)
+		rs->process = up ? k->upsample_float : k->downsample_float;
+	else
+		rs->process = up ? k->upsample_s16 : k->downsample_s16;
 
 	return 0;
 }
 
-struct resampler *rs_open(size_t chnum, size_t out_rate, size_t in_rate)
+struct resampler *rs_open(size_t chnum, enum rs_format format,
+                          size_t out_rate, size_t in_rate)
 {
-	struct resampler *rs = calloc(1, sizeof(struct resampler));
+	struct resampler *rs;
+
+	if (!chnum)
+		return NULL;
+
+	rs = calloc(1, sizeof(struct resampler) + 2 * chnum * sizeof(float));
 	if (!rs)
 		return NULL;
-	if (chnum > MAX_CHNUM) {
-		goto error;
-	}
 	rs->chnum = chnum;
-	rs_adjust(rs, out_rate, in_rate);
+	rs->format = format;
+	rs->old_frame = rs->frames;
+	rs->new_frame = rs->frames + chnum;
+	/* prime both history frames before the first output */
+	rs->phase = 2 * PHASE_ONE;
+	if (rs_adjust(rs, out_rate, in_rate) != 0)
+		goto error;
 
 	return rs;
 
@@ -146,10 +250,17 @@ error:
 	return NULL;
 }
 
-void rs_process(struct resampler *rs, int16_t *dst, size_t dst_frames,
-                const int16_t *src, size_t src_frames)
+size_t rs_get_src_frames(struct resampler *rs, size_t dst_frames)
+{
+	if (!dst_frames)
+		return 0;
+	return (rs->phase + (dst_frames - 1) * rs->step) >> PHASE_SHIFT;
+}
+
+void rs_process(struct resampler *rs, void *dst, size_t *dst_frames,
+                const void *src, size_t *src_frames)
 {
-	rs->process_s16(rs, dst, dst_frames, src, src_frames);
+	rs->process(rs, dst, dst_frames, src, src_frames);
 }
 
 void rs_close(struct resampler *rs)
@@ -26,9 +26,24 @@
 
 struct resampler;
 
-struct resampler *rs_open(size_t chnum, size_t out_rate, size_t in_rate);
-void rs_process(struct resampler *rs, int16_t *dst, size_t dst_frames,
-                const int16_t *src, size_t src_frames);
+enum rs_format {
+	RS_FORMAT_S16,
+	RS_FORMAT_FLOAT,
+};
+
+struct resampler *rs_open(size_t chnum, enum rs_format format,
+                          size_t out_rate, size_t in_rate);
+/* Resamples a stream chunk by chunk, carrying the phase and the last
+ * input frames over from call to call, also across rs_adjust().
+ * On entry *dst_frames and *src_frames hold the room in dst and the
+ * frames in src, on return the frames produced and consumed.
+ */
+void rs_process(struct resampler *rs, void *dst, size_t *dst_frames,
+                const void *src, size_t *src_frames);
+/* Returns the exact number of input frames consumed by producing
+ * dst_frames output frames at the current ratio.
+ */
+size_t rs_get_src_frames(struct resampler *rs, size_t dst_frames);
 int rs_adjust(struct resampler *rs, size_t out_rate, size_t in_rate);
 void rs_close(struct resampler *rs);
 
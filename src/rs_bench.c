@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Throughput and quality of the resampler kernels, without audio hardware.
+ *
+ * Every case streams one second of a 997 Hz sine through rs_process() in
+ * fixed size output chunks, the way epcm does per period, and reports the
+ * best of a few passes. THD+N is the residual once the fundamental is
+ * fitted out of channel 0; SNR compares it with the ideal sine at the
+ * output rate, so it also counts the interpolator's droop.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+#include "resampler.h"
+
+#define TONE_HZ     997.0
+#define AMPLITUDE   0.5
+#define PASSES      5
+#define SKIP_FRAMES 64		/* settling of the history frames */
+
+struct rate_pair {
+	size_t in_rate;
+	size_t out_rate;
+};
+
+static const struct rate_pair rates[] = {
+	{ 48000, 48000 },
+	{ 48000, 48048 },	/* what the tuner does at +1000 ppm */
+	{ 44100, 48000 },
+	{ 48000, 44100 },
+	{ 16000, 48000 },
+	{ 96000, 48000 },
+};
+/* 3 is not specialized, it times the generic kernels */
+static const size_t channels[] = { 1, 2, 3, 4, 6, 8 };
+static const size_t chunks[] = { 64, 1024 };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void *make_input(enum rs_format format, size_t chnum, size_t rate, size_t frames)
+{
+	const size_t sample_bytes = format == RS_FORMAT_FLOAT ? sizeof(float) : sizeof(int16_t);
+	char *buf = (char *)malloc(frames * chnum * sample_bytes);
+	size_t i, ch;
+
+	if (!buf)
+		return NULL;
+	for (i = 0; i < frames; ++i) {
+		const double v = AMPLITUDE * sin(2.0 * M_PI * TONE_HZ * i / rate);
+		for (ch = 0; ch < chnum; ++ch) {
+			if (format == RS_FORMAT_FLOAT)
+				((float *)buf)[i * chnum + ch] = (float)v;
+			else
+				((int16_t *)buf)[i * chnum + ch] = (int16_t)lrint(v * 32768.0);
+		}
+	}
+	return buf;
+}
+
+static double sample(const void *buf, enum rs_format format, size_t chnum, size_t frame)
+{
+	if (format == RS_FORMAT_FLOAT)
+		return ((const float *)buf)[frame * chnum];
+	return ((const int16_t *)buf)[frame * chnum] / 32768.0;
+}
+
+/* Least squares fit of a sine and a cosine at the tone frequency */
+static void measure(const void *buf, enum rs_format format, size_t chnum,
+                    size_t rate, size_t frames, double *thdn_db, double *snr_db)
+{
+	double ss = 0, cc = 0, sc = 0, sy = 0, cy = 0;
+	double a, b, det, residual = 0, fundamental = 0, error = 0, reference = 0;
+	size_t i;
+
+	for (i = SKIP_FRAMES; i < frames; ++i) {
+		const double w = 2.0 * M_PI * TONE_HZ * i / rate;
+		const double s = sin(w), c = cos(w), y = sample(buf, format, chnum, i);
+		ss += s * s;
+		cc += c * c;
+		sc += s * c;
+		sy += s * y;
+		cy += c * y;
+	}
+	det = ss * cc - sc * sc;
+	a = (sy * cc - cy * sc) / det;
+	b = (cy * ss - sy * sc) / det;
+
+	for (i = SKIP_FRAMES; i < frames; ++i) {
+		const double w = 2.0 * M_PI * TONE_HZ * i / rate;
+		const double y = sample(buf, format, chnum, i);
+		const double fit = a * sin(w) + b * cos(w);
+		const double ideal = AMPLITUDE * sin(w);
+		residual += (y - fit) * (y - fit);
+		fundamental += fit * fit;
+		error += (y - ideal) * (y - ideal);
+		reference += ideal * ideal;
+	}
+	*thdn_db = 10.0 * log10(residual / fundamental);
+	*snr_db = 10.0 * log10(reference / error);
+}
+
+static int run(enum rs_format format, size_t chnum, const struct rate_pair *r, size_t chunk)
+{
+	const size_t sample_bytes = format == RS_FORMAT_FLOAT ? sizeof(float) : sizeof(int16_t);
+	const size_t frame_bytes = chnum * sample_bytes;
+	const size_t in_frames = r->in_rate;
+	/* leave the input a little longer than what the output needs */
+	const size_t out_frames = (size_t)((double)r->out_rate * (in_frames - 2) / r->in_rate);
+	char *in = (char *)make_input(format, chnum, r->in_rate, in_frames);
+	char *out = (char *)malloc(out_frames * frame_bytes);
+	double best = 1e9, thdn, snr;
+	uint64_t best_cycles = 0;
+	int pass, ret = -1;
+
+	if (!in || !out)
+		goto error;
+
+	for (pass = 0; pass < PASSES; ++pass) {
+		struct resampler *rs = rs_open(chnum, format, r->out_rate, r->in_rate);
+		size_t i = 0, j = 0;
+		double t;
+		uint64_t c;
+
+		if (!rs)
+			goto error;
+		t = now();
+		c = cycles();
+		while (j < out_frames) {
+			size_t dst_frames = out_frames - j < chunk ? out_frames - j : chunk;
+			size_t src_frames = rs_get_src_frames(rs, dst_frames);
+
+			if (src_frames > in_frames - i)
+				src_frames = in_frames - i;
+			rs_process(rs, out + j * frame_bytes, &dst_frames,
+			           in + i * frame_bytes, &src_frames);
+			if (!dst_frames)
+				break;
+			i += src_frames;
+			j += dst_frames;
+		}
+		c = cycles() - c;
+		t = now() - t;
+		rs_close(rs);
+		if (j != out_frames) {
+			fprintf(stderr, "short output: %zu of %zu frames\n", j, out_frames);
+			goto error;
+		}
+		if (t < best) {
+			best = t;
+			best_cycles = c;
+		}
+	}
+
+	measure(out, format, chnum, r->out_rate, out_frames, &thdn, &snr);
+	printf("%-5s %2zu ch %6zu -> %6zu %5zu | %7.2f ns/frame %8.2f Mframes/s",
+	       format == RS_FORMAT_FLOAT ? "float" : "s16", chnum, r->in_rate, r->out_rate,
+	       chunk, best * 1e9 / out_frames, out_frames / best * 1e-6);
+	if (best_cycles)
+		printf(" %7.2f cycles/frame", (double)best_cycles / out_frames);
+	printf(" | THD+N %7.2f dB SNR %6.2f dB\n", thdn, snr);
+	ret = 0;
+
+error:
+	free(in);
+	free(out);
+	return ret;
+}
+
+int main(void)
+{
+	static const enum rs_format formats[] = { RS_FORMAT_S16, RS_FORMAT_FLOAT };
+	size_t f, c, r, k;
+	int ret = EXIT_SUCCESS;
+
+	for (f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f)
+		for (c = 0; c < sizeof(channels) / sizeof(channels[0]); ++c)
+			for (r = 0; r < sizeof(rates) / sizeof(rates[0]); ++r)
+				for (k = 0; k < sizeof(chunks) / sizeof(chunks[0]); ++k)
+					if (run(formats[f], channels[c], &rates[r], chunks[k]) != 0)
+						ret = EXIT_FAILURE;
+
+	return ret;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __SEQLOCK_H__
+#define __SEQLOCK_H__
+
+/* Sequence counter for data with a single writer. The writer makes it
+ * odd while it updates, readers copy the data and retry when the count
+ * was odd or moved meanwhile, so neither side ever blocks the other.
+ */
+static inline void seqlock_write_begin(unsigned int *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(unsigned int *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int seqlock_read_begin(const unsigned int *seq)
+{
+	return __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+}
+
+static inline int seqlock_read_retry(const unsigned int *seq, unsigned int start)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (start & 1) || __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+#endif
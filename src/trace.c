@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+/* Rounds events up to a power of two */
+struct trace *trace_open(size_t events)
+{
+	struct trace *t = (struct trace *)calloc(1, sizeof(struct trace));
+	size_t size = 1;
+
+	if (!t)
+		return NULL;
+	while (size < events)
+		size <<= 1;
+	t->slots = (struct trace_slot *)calloc(size, sizeof(struct trace_slot));
+	if (!t->slots) {
+		free(t);
+		return NULL;
+	}
+	t->mask = size - 1;
+
+	return t;
+}
+
+/* Copies up to count of the most recent events, oldest first */
+size_t trace_read(struct trace *t, struct epcm_trace_event *events, size_t count)
+{
+	const uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+	const uint64_t size = t->mask + 1;
+	uint64_t n = head > size ? head - size : 0;
+	size_t copied = 0;
+
+	if (head - n > count)
+		n = head - count;
+	for (; n < head; ++n) {
+		const struct trace_slot *slot = &t->slots[n & t->mask];
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != n + 1)
+			continue;
+		events[copied] = slot->ev;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == n + 1)
+			++copied;
+	}
+
+	return copied;
+}
+
+void trace_close(struct trace *t)
+{
+	if (t) {
+		free(t->slots);
+		free(t);
+	}
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <klogging.h>
+#include <easoundlib.h>
+
+/* Per transfer verbose logs, compiled out with -DEPCM_NO_HOT_KLOGV.
+ * The trace ring below records the same events for a fraction of the cost.
+ */
+#ifdef EPCM_NO_HOT_KLOGV
+#define HOT_KLOGV(...) do { } while (0)
+#else
+#define HOT_KLOGV(...) KLOGV(__VA_ARGS__)
+#endif
+
+struct trace_slot {
+	uint64_t seq;		/* index + 1 once written, 0 while being written */
+	struct epcm_trace_event ev;
+};
+
+/* Ring of the last events, written by any thread without a lock. A
+ * writer claims a slot by bumping head and publishes it through seq, a
+ * reader skips the slots overwritten while it copies them.
+ */
+struct trace {
+	uint64_t head;
+	size_t mask;
+	struct trace_slot *slots;
+};
+
+static inline void trace_add(struct trace *t, unsigned int id, size_t level, long value)
+{
+	struct timespec ts;
+	struct trace_slot *slot;
+	uint64_t n;
+
+	if (!t)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	n = __atomic_fetch_add(&t->head, 1, __ATOMIC_RELAXED);
+	slot = &t->slots[n & t->mask];
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->ev.nsecs = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	slot->ev.id = id;
+	slot->ev.level = level;
+	slot->ev.value = value;
+	__atomic_store_n(&slot->seq, n + 1, __ATOMIC_RELEASE);
+}
+
+struct trace *trace_open(size_t events);
+size_t trace_read(struct trace *t, struct epcm_trace_event *events, size_t count);
+void trace_close(struct trace *t);
+
+#endif
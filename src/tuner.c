@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "tuner.h"
+
+/* Time constant of the fill level low-pass filter */
+#define TUNER_SMOOTHING_MILLISECS 500
+
+void tuner_init(struct tuner *t, unsigned int rate, size_t target_frames,
+                unsigned int max_ppm, double kp, double ki)
+{
+	const double frames_per_ms = rate / 1000.0;
+
+	t->rate = rate;
+	t->target = target_frames;
+	t->max_ppm = max_ppm ? max_ppm : TUNER_DEFAULT_MAX_PPM;
+	/* convert the gains from milliseconds and seconds to frames */
+	t->kp = (kp > 0 ? kp : TUNER_DEFAULT_KP) / frames_per_ms;
+	t->ki = (ki > 0 ? ki : TUNER_DEFAULT_KI) / frames_per_ms / rate;
+	t->smoothing = TUNER_SMOOTHING_MILLISECS * frames_per_ms;
+
+	t->level = 0;
+	t->integral = 0;
+	t->ppm = 0;
+	t->primed = 0;
+}
+
+/* Feeds the fill level observed before moving 'frames' client frames,
+ * and returns the new ratio in ppm.
+ */
+double tuner_update(struct tuner *t, double level_frames, size_t frames)
+{
+	double error, p;
+
+	if (!t->primed) {
+		t->level = level_frames;
+		t->primed = 1;
+	} else {
+		t->level += (level_frames - t->level) * frames / (t->smoothing + frames);
+	}
+
+	error = t->level - t->target;
+	p = t->kp * error + t->integral;
+	if (p > t->max_ppm) {
+		p = t->max_ppm;
+	} else if (p < -t->max_ppm) {
+		p = -t->max_ppm;
+	} else {
+		/* integrate only while unsaturated to avoid windup */
+		t->integral += t->ki * error * frames;
+	}
+	t->ppm = p;
+
+	return t->ppm;
+}
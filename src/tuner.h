@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __TUNER_H__
+#define __TUNER_H__
+
+#include <stddef.h>
+
+#define TUNER_DEFAULT_MAX_PPM 2000
+#define TUNER_DEFAULT_KP      50.0	/* ppm per millisecond of error */
+#define TUNER_DEFAULT_KI      0.6	/* ppm per millisecond of error per second */
+
+/* PI controller holding the fill level of the extended buffer at a
+ * target. Its output is a ratio in parts per million: a positive value
+ * makes the client side drain the queue faster, by reading more queue
+ * frames per client frame on capture and by writing fewer on playback.
+ */
+struct tuner {
+	unsigned int rate;
+	double target;		/* frames */
+	double kp;		/* ppm per frame of error */
+	double ki;		/* ppm per frame of error per frame */
+	double max_ppm;
+	double smoothing;	/* frames */
+
+	double level;		/* low-pass filtered fill level, frames */
+	double integral;	/* ppm */
+	double ppm;
+	int primed;
+};
+
+void tuner_init(struct tuner *t, unsigned int rate, size_t target_frames,
+                unsigned int max_ppm, double kp, double ki);
+double tuner_update(struct tuner *t, double level_frames, size_t frames);
+
+#endif
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <klogging.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "backend.h"
+
+/* A virtual device moves one period per tick of a timerfd, in a buffer
+ * of period_count periods. Ticks follow the configured rate off by the
+ * drift, each one late by a random jitter, and the clock stops for a
+ * while every so often to mimic a stalled device. Like a real device it
+ * keeps running whether or not it is fed, counting the xruns.
+ */
+struct vpcm {
+	struct epcm_virtual vdev;
+	int capture;
+	int tfd;
+	int running;
+	double period_ns;	/* at the drifted rate */
+	uint64_t start_ns;	/* shifted by every stall */
+	uint64_t tick;		/* index of the next tick */
+	uint64_t next_ns;	/* when the next tick fires, jitter included */
+	uint64_t stall_ticks;	/* ticks in between stalls, 0 for none */
+	unsigned int seed;
+	size_t level;		/* frames in the device buffer */
+	unsigned int xruns;
+};
+
+static uint64_t vpcm_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void vpcm_schedule(struct vpcm *v)
+{
+	if (v->stall_ticks && v->tick % v->stall_ticks == 0)
+		v->start_ns += (uint64_t)v->vdev.stall_millisecs * 1000000;
+	v->next_ns = v->start_ns + (uint64_t)(v->tick * v->period_ns);
+	if (v->vdev.jitter_usecs)
+		v->next_ns += (uint64_t)(rand_r(&v->seed) % v->vdev.jitter_usecs) * 1000;
+}
+
+static void vpcm_start(struct vpcm *v)
+{
+	v->start_ns = vpcm_now();
+	v->tick = 1;
+	v->running = 1;
+	vpcm_schedule(v);
+}
+
+/* Runs the ticks due by now, or when wait is set, blocks for at least one */
+static int vpcm_advance(struct backend *be, int wait)
+{
+	struct vpcm *v = (struct vpcm *)be->priv;
+	const size_t period = be->config.period_size;
+
+	for (;;) {
+		if (vpcm_now() < v->next_ns) {
+			struct itimerspec its;
+			uint64_t expirations;
+
+			if (!wait)
+				break;
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_sec = v->next_ns / 1000000000;
+			its.it_value.tv_nsec = v->next_ns % 1000000000;
+			if (timerfd_settime(v->tfd, TFD_TIMER_ABSTIME, &its, NULL) != 0 ||
+			    read(v->tfd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+				KLOGE("vpcm: timerfd failed");
+				return -1;
+			}
+		}
+
+		if (v->capture) {
+			v->level += period;
+			if (v->level > be->buffer_size) {
+				v->level = be->buffer_size;
+				++v->xruns;
+				KLOGD("vpcm: overrun #%u", v->xruns);
+			}
+		} else {
+			if (v->level < period) {
+				++v->xruns;
+				KLOGD("vpcm: underrun #%u", v->xruns);
+				v->level = 0;
+			} else {
+				v->level -= period;
+			}
+		}
+		++v->tick;
+		vpcm_schedule(v);
+		wait = 0;
+	}
+
+	return 0;
+}
+
+static int vpcm_read(struct backend *be, void *data, unsigned int count)
+{
+	struct vpcm *v = (struct vpcm *)be->priv;
+	char *p = (char *)data;
+	size_t frames = count / be->frame_bytes;
+
+	if (!v->running)
+		vpcm_start(v);
+
+	while (frames) {
+		size_t n = frames < v->level ? frames : v->level;
+
+		if (vpcm_advance(be, n == 0) != 0)
+			return -1;
+		if (n == 0)
+			continue;
+		if (v->vdev.xfer)
+			v->vdev.xfer(v->vdev.arg, p, n);
+		else
+			memset(p, 0, n * be->frame_bytes);
+		v->level -= n;
+		p += n * be->frame_bytes;
+		frames -= n;
+	}
+
+	return 0;
+}
+
+static int vpcm_write(struct backend *be, const void *data, unsigned int count)
+{
+	struct vpcm *v = (struct vpcm *)be->priv;
+	const char *p = (const char *)data;
+	size_t frames = count / be->frame_bytes;
+
+	while (frames) {
+		const size_t room = be->buffer_size - v->level;
+		const size_t n = frames < room ? frames : room;
+
+		if (v->running && vpcm_advance(be, n == 0) != 0)
+			return -1;
+		if (n == 0)
+			continue;
+		if (v->vdev.xfer)
+			v->vdev.xfer(v->vdev.arg, (void *)p, n);
+		v->level += n;
+		p += n * be->frame_bytes;
+		frames -= n;
+		/* starts once the buffer is full, as with the default start_threshold */
+		if (!v->running && v->level == be->buffer_size)
+			vpcm_start(v);
+	}
+
+	return 0;
+}
+
+static void vpcm_close(struct backend *be)
+{
+	struct vpcm *v = (struct vpcm *)be->priv;
+
+	if (v) {
+		KLOGD("vpcm: closed after %u xruns", v->xruns);
+		close(v->tfd);
+		free(v);
+	}
+	be->priv = NULL;
+}
+
+static const struct backend_ops vpcm_ops = {
+	.read = vpcm_read,
+	.write = vpcm_write,
+	.close = vpcm_close,
+};
+
+int backend_open_virtual(struct backend *be, unsigned int flags,
+                         const struct pcm_config *config,
+                         const struct epcm_virtual *vdev)
+{
+	struct vpcm *v;
+
+	if (!config->rate || !config->channels || !config->period_size ||
+	    config->period_count < 2 || !pcm_format_to_bits(config->format)) {
+		KLOGE("vpcm: invalid config");
+		return -1;
+	}
+	if (vdev->drift_ppm <= -1000000) {
+		KLOGE("vpcm: drift %d ppm is out of range", vdev->drift_ppm);
+		return -1;
+	}
+
+	v = (struct vpcm *)calloc(1, sizeof(struct vpcm));
+	if (!v) {
+		KLOGE("vpcm: Failed to alloc");
+		return -1;
+	}
+	v->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (v->tfd < 0) {
+		KLOGE("vpcm: Failed to create timerfd");
+		free(v);
+		return -1;
+	}
+	v->vdev = *vdev;
+	v->capture = !!(flags & PCM_IN);
+	v->period_ns = (double)config->period_size * 1e9 / config->rate
+	               * 1e6 / (1e6 + vdev->drift_ppm);
+	if (vdev->stall_every_millisecs && vdev->stall_millisecs) {
+		v->stall_ticks = (uint64_t)vdev->stall_every_millisecs * config->rate
+		                 / 1000 / config->period_size;
+		if (!v->stall_ticks)
+			v->stall_ticks = 1;
+	}
+	v->seed = 1;
+
+	be->ops = &vpcm_ops;
+	be->pcm = NULL;
+	be->config = *config;
+	be->buffer_size = config->period_size * config->period_count;
+	be->frame_bytes = config->channels * (pcm_format_to_bits(config->format) / 8);
+	be->priv = v;
+	KLOGD("vpcm: %u Hz %+d ppm, jitter %u us, stall %u ms every %u ms",
+	      config->rate, vdev->drift_ppm, vdev->jitter_usecs,
+	      vdev->stall_millisecs, vdev->stall_every_millisecs);
+
+	return 0;
+}
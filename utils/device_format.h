@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __DEVICE_FORMAT_H__
+#define __DEVICE_FORMAT_H__
+
+#include <tinyalsa/asoundlib.h>
+
+/* Picks the device format for a client format: the client format itself
+ * when the device takes it, else the widest one it does. Clients in a
+ * format tinyalsa does not know, such as float, pass PCM_FORMAT_INVALID.
+ */
+static inline enum pcm_format device_format_pick(unsigned int card,
+                                                 unsigned int device,
+                                                 unsigned int flags,
+                                                 enum pcm_format wanted)
+{
+	static const enum pcm_format widest[] = {
+		PCM_FORMAT_S32_LE,
+		PCM_FORMAT_S24_LE,
+		PCM_FORMAT_S24_3LE,
+		PCM_FORMAT_S16_LE,
+	};
+	struct pcm_params *params = pcm_params_get(card, device, flags);
+	enum pcm_format format = wanted == PCM_FORMAT_INVALID ? PCM_FORMAT_S16_LE : wanted;
+	size_t i;
+
+	if (!params)
+		return format;
+	if (wanted == PCM_FORMAT_INVALID || !pcm_params_format_test(params, wanted)) {
+		for (i = 0; i < sizeof(widest) / sizeof(widest[0]); ++i) {
+			if (pcm_params_format_test(params, widest[i])) {
+				format = widest[i];
+				break;
+			}
+		}
+	}
+	pcm_params_free(params);
+
+	return format;
+}
+
+#endif
@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <klogging.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "disk_writer.h"
+
+struct disk_writer {
+	const struct disk_writer_ops *ops;
+	void *arg;
+	size_t buf_size;
+	unsigned int count;
+	char **bufs;
+	size_t *fill;
+	int *last;		/* the buffer ends a segment */
+	unsigned int head;	/* filled by the caller */
+	unsigned int tail;	/* next to write */
+	unsigned int queued;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t tid;
+	int stop;
+	int error;
+	size_t prealloc;
+	int ahead;
+	unsigned long waits;
+
+	/* current segment, owned by the thread */
+	unsigned int index;
+	int fd;
+	int next_fd;
+	int direct;
+	off_t offset;
+	off_t allocated;
+	char *block;		/* first block of the file */
+	size_t block_bytes;
+	time_t refreshed;
+};
+
+static time_t disk_writer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static int disk_writer_pwrite(struct disk_writer *w, const char *p, size_t bytes)
+{
+	while (bytes) {
+		const ssize_t n = pwrite(w->fd, p, bytes, w->offset);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			KLOGE("Error to write %u bytes: %s", bytes, strerror(errno));
+			return -1;
+		}
+		p += n;
+		bytes -= n;
+		w->offset += n;
+	}
+	return 0;
+}
+
+static void disk_writer_clear_direct(struct disk_writer *w)
+{
+	if (w->direct) {
+		fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+		w->direct = 0;
+	}
+}
+
+/* Only the last buffer of a segment can be short, its unaligned tail is
+ * written without O_DIRECT.
+ */
+static int disk_writer_flush(struct disk_writer *w, const char *p, size_t bytes)
+{
+	if (w->prealloc && w->offset + (off_t)bytes > w->allocated) {
+		const off_t len = bytes > w->prealloc ? bytes : w->prealloc;
+		int err = posix_fallocate(w->fd, w->allocated, len);
+
+		/* e.g. EOPNOTSUPP on FAT, or EINVAL from the glibc emulation
+		 * on an O_DIRECT fd: give up for the rest of the recording
+		 */
+		if (err) {
+			KLOGW("posix_fallocate: %s, preallocation disabled", strerror(err));
+			w->prealloc = 0;
+		} else {
+			w->allocated += len;
+		}
+	}
+
+	if (w->offset == 0) {
+		w->block_bytes = bytes < DISK_WRITER_ALIGN ? bytes : DISK_WRITER_ALIGN;
+		memcpy(w->block, p, w->block_bytes);
+	}
+
+	if (w->direct && bytes % DISK_WRITER_ALIGN) {
+		const size_t aligned = bytes - bytes % DISK_WRITER_ALIGN;
+
+		if (disk_writer_pwrite(w, p, aligned) != 0)
+			return -1;
+		disk_writer_clear_direct(w);
+		p += aligned;
+		bytes -= aligned;
+	}
+	return disk_writer_pwrite(w, p, bytes);
+}
+
+/* A whole block keeps O_DIRECT happy, the data after the header is the
+ * copy of what was written there.
+ */
+static void disk_writer_refresh(struct disk_writer *w)
+{
+	w->ops->header(w->arg, w->block, w->offset);
+	if (pwrite(w->fd, w->block, w->block_bytes, 0) != (ssize_t)w->block_bytes)
+		KLOGW("Failed to refresh the header of segment %u", w->index);
+	w->refreshed = disk_writer_now();
+}
+
+static int disk_writer_begin(struct disk_writer *w, int fd)
+{
+	w->fd = fd >= 0 ? fd : w->ops->open(w->arg, w->index);
+	w->next_fd = -1;
+	if (w->fd < 0)
+		return -1;
+	w->direct = !!(fcntl(w->fd, F_GETFL) & O_DIRECT);
+	w->offset = 0;
+	w->allocated = lseek(w->fd, 0, SEEK_END);
+	w->block_bytes = 0;
+	w->refreshed = disk_writer_now();
+	if (w->ahead)
+		w->next_fd = w->ops->open(w->arg, w->index + 1);
+	return 0;
+}
+
+static void disk_writer_end(struct disk_writer *w)
+{
+	if (w->fd < 0)
+		return;
+	disk_writer_clear_direct(w);
+	if (w->block_bytes)
+		disk_writer_refresh(w);
+	if (w->allocated > w->offset && ftruncate(w->fd, w->offset) != 0)
+		KLOGW("Failed to trim the preallocation of segment %u", w->index);
+	close(w->fd);
+	w->fd = -1;
+	KLOGD("disk_writer: segment %u, %llu bytes", w->index, (unsigned long long)w->offset);
+}
+
+static void *disk_writer_thread(void *data)
+{
+	struct disk_writer *w = (struct disk_writer *)data;
+	int pending = 0;	/* the next segment starts with the next buffer */
+
+	pthread_mutex_lock(&w->mutex);
+	for (;;) {
+		while (!w->queued && !w->stop)
+			pthread_cond_wait(&w->cond, &w->mutex);
+		if (!w->queued)
+			break;
+		pthread_mutex_unlock(&w->mutex);
+
+		if (pending) {
+			++w->index;
+			if (disk_writer_begin(w, w->next_fd) != 0)
+				w->error = 1;
+			pending = 0;
+		}
+		/* keep draining after an error so that the caller never waits */
+		if (w->fd >= 0 && !w->error) {
+			if (disk_writer_flush(w, w->bufs[w->tail], w->fill[w->tail]) != 0)
+				w->error = 1;
+			else if (w->offset >= DISK_WRITER_ALIGN && disk_writer_now() != w->refreshed)
+				disk_writer_refresh(w);
+		}
+		if (w->last[w->tail]) {
+			disk_writer_end(w);
+			pending = 1;
+		}
+
+		pthread_mutex_lock(&w->mutex);
+		w->tail = (w->tail + 1) % w->count;
+		--w->queued;
+		pthread_cond_signal(&w->cond);
+	}
+	pthread_mutex_unlock(&w->mutex);
+
+	disk_writer_end(w);
+	if (w->next_fd >= 0)
+		w->ops->discard(w->arg, w->next_fd, w->index + 1);
+
+	return NULL;
+}
+
+static void disk_writer_free(struct disk_writer *w)
+{
+	unsigned int i;
+
+	if (w->bufs) {
+		for (i = 0; i < w->count; ++i)
+			free(w->bufs[i]);
+	}
+	free(w->bufs);
+	free(w->fill);
+	free(w->last);
+	free(w->block);
+	free(w);
+}
+
+struct disk_writer *disk_writer_open(const struct disk_writer_ops *ops, void *arg,
+                                     size_t buf_size, unsigned int count,
+                                     size_t prealloc, int ahead)
+{
+	struct disk_writer *w = (struct disk_writer *)calloc(1, sizeof(struct disk_writer));
+	unsigned int i;
+
+	if (!w) {
+		KLOGE("Failed to alloc the disk writer");
+		return NULL;
+	}
+	w->ops = ops;
+	w->arg = arg;
+	w->buf_size = (buf_size + DISK_WRITER_ALIGN - 1) / DISK_WRITER_ALIGN * DISK_WRITER_ALIGN;
+	w->count = count < 2 ? 2 : count;
+	w->prealloc = prealloc;
+	w->ahead = ahead;
+	w->fd = w->next_fd = -1;
+
+	w->bufs = (char **)calloc(w->count, sizeof(char *));
+	w->fill = (size_t *)calloc(w->count, sizeof(size_t));
+	w->last = (int *)calloc(w->count, sizeof(int));
+	if (!w->bufs || !w->fill || !w->last ||
+	    posix_memalign((void **)&w->block, DISK_WRITER_ALIGN, DISK_WRITER_ALIGN) != 0) {
+		w->block = NULL;
+		KLOGE("Failed to alloc the disk writer");
+		goto error;
+	}
+	for (i = 0; i < w->count; ++i) {
+		if (posix_memalign((void **)&w->bufs[i], DISK_WRITER_ALIGN, w->buf_size) != 0) {
+			w->bufs[i] = NULL;
+			KLOGE("Failed to alloc the disk writer");
+			goto error;
+		}
+	}
+
+	if (disk_writer_begin(w, -1) != 0)
+		goto error;
+
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->tid, NULL, disk_writer_thread, w) != 0) {
+		KLOGE("Failed to create the disk writer thread");
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->mutex);
+		goto error;
+	}
+
+	KLOGD("disk_writer: %u x %u bytes%s", w->count, w->buf_size,
+	      w->direct ? ", O_DIRECT" : "");
+	return w;
+
+error:
+	if (w->fd >= 0)
+		close(w->fd);
+	if (w->next_fd >= 0)
+		ops->discard(arg, w->next_fd, w->index + 1);
+	disk_writer_free(w);
+	return NULL;
+}
+
+/* Hands the head buffer to the thread and waits for a free one */
+static void disk_writer_queue(struct disk_writer *w, int last)
+{
+	w->last[w->head] = last;
+	pthread_mutex_lock(&w->mutex);
+	++w->queued;
+	w->head = (w->head + 1) % w->count;
+	pthread_cond_signal(&w->cond);
+	if (w->queued == w->count) {
+		++w->waits;
+		KLOGW("disk_writer: all %u buffers queued, waiting for the disk", w->count);
+		while (w->queued == w->count)
+			pthread_cond_wait(&w->cond, &w->mutex);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	w->fill[w->head] = 0;
+}
+
+void disk_writer_write(struct disk_writer *w, const void *data, size_t bytes)
+{
+	const char *p = (const char *)data;
+
+	while (bytes) {
+		size_t *fill = &w->fill[w->head];
+		const size_t n = bytes < w->buf_size - *fill ? bytes : w->buf_size - *fill;
+
+		memcpy(w->bufs[w->head] + *fill, p, n);
+		*fill += n;
+		p += n;
+		bytes -= n;
+		if (*fill == w->buf_size)
+			disk_writer_queue(w, 0);
+	}
+}
+
+void disk_writer_split(struct disk_writer *w)
+{
+	disk_writer_queue(w, 1);
+}
+
+int disk_writer_close(struct disk_writer *w)
+{
+	int ret;
+
+	if (!w)
+		return 0;
+
+	pthread_mutex_lock(&w->mutex);
+	if (w->fill[w->head]) {
+		w->last[w->head] = 0;
+		++w->queued;
+		w->head = (w->head + 1) % w->count;
+	}
+	w->stop = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+	pthread_join(w->tid, NULL);
+
+	if (w->waits)
+		KLOGW("disk_writer: waited for the disk %lu times", w->waits);
+	ret = w->error ? -1 : 0;
+
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->mutex);
+	disk_writer_free(w);
+
+	return ret;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __DISK_WRITER_H__
+#define __DISK_WRITER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DISK_WRITER_ALIGN 4096
+
+/* Stores a stream from its own thread, so that a slow disk does not hold
+ * up the caller. Data is gathered into a pool of count aligned buffers of
+ * buf_size bytes and each full buffer is written in one go, with O_DIRECT
+ * when the file was opened with it. With prealloc, files are grown by
+ * posix_fallocate() that many bytes ahead of the writes.
+ *
+ * The stream can be split into segments, each in its own file. The
+ * files come from ops->open(), which the thread calls for the next
+ * segment as soon as one starts when ahead is set, so that switching
+ * costs nothing. Every second and when a segment ends, ops->header()
+ * updates the header in a copy of the first block of the file, which is
+ * then written back in place.
+ */
+struct disk_writer_ops {
+	int (*open)(void *arg, unsigned int index);
+	void (*header)(void *arg, char *block, uint64_t bytes);
+	/* a file opened ahead but never written */
+	void (*discard)(void *arg, int fd, unsigned int index);
+};
+
+struct disk_writer;
+
+struct disk_writer *disk_writer_open(const struct disk_writer_ops *ops, void *arg,
+                                     size_t buf_size, unsigned int count,
+                                     size_t prealloc, int ahead);
+/* Copies into the pool, waits only when every buffer is still queued */
+void disk_writer_write(struct disk_writer *w, const void *data, size_t bytes);
+/* Ends the current segment after what was written so far */
+void disk_writer_split(struct disk_writer *w);
+/* Writes what is left and closes the last segment. Returns -1 if any
+ * write failed.
+ */
+int disk_writer_close(struct disk_writer *w);
+
+#endif
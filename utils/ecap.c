@@ -18,16 +18,110 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#define _GNU_SOURCE
 #include <easoundlib.h>
 #include <klogging.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include "wav_header.h"
+#include "device_format.h"
+#include "disk_writer.h"
+#include "pipe_io.h"
+
+#define WRITER_BUFFER_BYTES (1 << 20)
+#define PIPE_BYTES (1 << 20)
 
 static int g_quit;
 
+/* The files of a recording, opened from the disk writer thread */
+struct recording {
+	const char *path;
+	int segmented;
+	int direct;
+	int raw;		/* no header */
+	off_t segment_bytes;
+	struct wav_header64 header;
+};
+
+/* Segments are numbered in front of the extension, rec.wav is followed
+ * by rec-0001.wav and so on.
+ */
+static void recording_path(const struct recording *r, unsigned int index,
+                           char *path, size_t size)
+{
+	const char *dot = strrchr(r->path, '.');
+	const char *slash = strrchr(r->path, '/');
+
+	if (!r->segmented || !index) {
+		snprintf(path, size, "%s", r->path);
+		return;
+	}
+	if (!dot || (slash && dot < slash))
+		dot = r->path + strlen(r->path);
+	snprintf(path, size, "%.*s-%04u%s", (int)(dot - r->path), r->path, index, dot);
+}
+
+static int recording_open(void *arg, unsigned int index)
+{
+	struct recording *r = (struct recording *)arg;
+	const int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	char path[4096];
+	int fd = -1;
+	int err;
+
+	recording_path(r, index, path, sizeof(path));
+	if (r->direct) {
+		fd = open(path, flags | O_DIRECT, 0644);
+		if (fd < 0)
+			KLOGW("No O_DIRECT on %s, writing through the page cache", path);
+	}
+	if (fd < 0)
+		fd = open(path, flags, 0644);
+	if (fd < 0) {
+		KLOGE("Unable to open %s", path);
+		return -1;
+	}
+	if (r->segment_bytes) {
+		err = posix_fallocate(fd, 0, r->segment_bytes);
+		if (err)
+			KLOGW("posix_fallocate(%s): %s", path, strerror(err));
+	}
+	KLOGD("Recording to %s", path);
+
+	return fd;
+}
+
+static void recording_header(void *arg, char *block, uint64_t bytes)
+{
+	const struct recording *r = (const struct recording *)arg;
+	struct wav_header64 header = r->header;
+
+	if (r->raw)
+		return;
+	wav_header64_set_size(&header, bytes - sizeof(header));
+	memcpy(block, &header, sizeof(header));
+}
+
+static void recording_discard(void *arg, int fd, unsigned int index)
+{
+	struct recording *r = (struct recording *)arg;
+	char path[4096];
+
+	close(fd);
+	recording_path(r, index, path, sizeof(path));
+	unlink(path);
+}
+
+static const struct disk_writer_ops recording_ops = {
+	.open = recording_open,
+	.header = recording_header,
+	.discard = recording_discard,
+};
+
 static void sigint_handler(int sig)
 {
 	if (sig == SIGINT) {
@@ -42,46 +136,47 @@ int main(int argc, char *argv[])
 	struct pcm_config config;
 	struct epcm *epcm = NULL;
 	struct epcm_config econfig;
-	FILE *file = NULL;
-	struct wav_header header;
+	struct recording rec;
+	struct wav_fmt wav;
+	struct disk_writer *writer = NULL;
+	unsigned int segment_secs = 0;
+	unsigned int segment_mb = 0;
+	size_t segment_frames = 0;
+	size_t segment_pos = 0;
+	unsigned int writer_buffers = 8;
+	size_t prealloc_mb = 0;
+	int direct = 0;
 	unsigned int card = 0;
 	unsigned int device = 0;
 	unsigned int channels = 2;
 	unsigned int rate = 48000;
 	unsigned int bits = 16;
+	int is_float = 0;
 	unsigned int frames;
 	unsigned int period_size = 1024;
 	unsigned int period_count = 4;
 	enum pcm_format format = PCM_FORMAT_S16_LE;
+	enum pcm_format device_format;
+	enum epcm_format app_format = EPCM_FORMAT_S16_LE;
 	size_t extended_buffer_ms = 0;
 
 	char c = -1;
 	char *buf = NULL;
+	unsigned int buffers = 1;
+	unsigned int buf_index = 0;
 	size_t read_size = 0;
 	size_t read_frames = 0;
 	size_t total_frames = 0;
+	const char *path = NULL;
+	int to_stdout = 0;
+	int raw = 0;
+	int splice = 0;
 
 	KLOG_SET_OPTIONS(KLOGGING_TO_STDOUT | KLOGGING_FLUSH_IMMEDIATELY | KLOGGING_NO_SOURCEFILE);
 	KLOG_SET_LEVEL(KLOGGING_LEVEL_VERBOSE);
 	KLOG_SET(argc, argv);
 
-	KCONSOLE("ecap version: %s", VERSION);
-	KCONSOLE("klogging version: %s", KVERSION());
-
-	if (argc < 2) {
-		KCONSOLE("Usage: ecap {file.wav} [-D card] [-d device] [-c channels] "
-		         "[-r rate] [-b bits] [-p period_size] [-n n_periods] "
-		         "[-e extended_buffer_ms]");
-		goto error;
-	}
-
-	file = fopen(argv[1], "wb");
-	if (!file) {
-		KLOGE("Unable to open %s", argv[1]);
-		goto error;
-	}
-
-	while ((c = getopt(argc, argv, "D:d:c:r:b:p:n:e:")) != -1) {
+	while ((c = getopt(argc, argv, "D:d:c:r:b:fp:n:e:w:a:Os:S:R")) != -1) {
 		switch (c) {
 		case 'd':
 			device = atoi(optarg);
@@ -95,6 +190,9 @@ int main(int argc, char *argv[])
 		case 'b':
 			bits = atoi(optarg);
 			break;
+		case 'f':
+			is_float = 1;
+			break;
 		case 'D':
 			card = atoi(optarg);
 			break;
@@ -107,38 +205,105 @@ int main(int argc, char *argv[])
 		case 'e':
 			extended_buffer_ms = atoi(optarg);
 			break;
+		case 'w':
+			writer_buffers = atoi(optarg);
+			break;
+		case 'a':
+			prealloc_mb = atoi(optarg);
+			break;
+		case 'O':
+			direct = 1;
+			break;
+		case 's':
+			segment_secs = atoi(optarg);
+			break;
+		case 'S':
+			segment_mb = atoi(optarg);
+			break;
+		case 'R':
+			raw = 1;
+			break;
 		case '?':
 			KLOGE("Unknown option: %c", c);
 			goto error;
 		}
 	}
 
-	header.riff_id = ID_RIFF;
-	header.riff_sz = 0;
-	header.riff_fmt = ID_WAVE;
-	header.fmt_id = ID_FMT;
-	header.fmt_sz = 16;
-	header.audio_format = FORMAT_PCM;
-	header.num_channels = channels;
-	header.sample_rate = rate;
-	switch (bits) {
-	case 32:
-		format = PCM_FORMAT_S32_LE;
-		break;
-	case 24:
-		format = PCM_FORMAT_S24_LE;
-		break;
-	case 16:
-		format = PCM_FORMAT_S16_LE;
-		break;
-	default:
-		KLOGE("%u bits is not supported", bits);
+	/* getopt() moves the file after the options, wherever it was given */
+	if (optind < argc) {
+		path = argv[optind];
+		to_stdout = !strcmp(path, "-");
+	}
+	/* stdout carries the samples with "-" */
+	if (to_stdout)
+		KLOG_SET_OPTIONS(KLOGGING_TO_STDERR | KLOGGING_FLUSH_IMMEDIATELY |
+		                 KLOGGING_NO_SOURCEFILE);
+
+	KCONSOLE("ecap version: %s", VERSION);
+	KCONSOLE("klogging version: %s", KVERSION());
+
+	if (!path) {
+		KCONSOLE("Usage: ecap {file.wav|-} [-D card] [-d device] [-c channels] "
+		         "[-r rate] [-b bits] [-f] [-p period_size] [-n n_periods] "
+		         "[-e extended_buffer_ms] [-w n_writer_buffers] [-a prealloc_mb] [-O] "
+		         "[-s segment_secs] [-S segment_mb] [-R]");
 		goto error;
 	}
-	header.bits_per_sample = pcm_format_to_bits(format);
-	header.byte_rate = (header.bits_per_sample / 8) * channels * rate;
-	header.block_align = channels * (header.bits_per_sample / 8);
-	header.data_id = ID_DATA;
+
+	memset(&rec, 0, sizeof(rec));
+	memset(&wav, 0, sizeof(wav));
+	wav.audio_format = is_float ? FORMAT_IEEE_FLOAT : FORMAT_PCM;
+	wav.num_channels = channels;
+	wav.sample_rate = rate;
+	if (is_float) {
+		bits = 32;
+		format = PCM_FORMAT_INVALID;
+		app_format = EPCM_FORMAT_FLOAT_LE;
+	} else {
+		switch (bits) {
+		case 32:
+			format = PCM_FORMAT_S32_LE;
+			app_format = EPCM_FORMAT_S32_LE;
+			break;
+		case 24:
+			format = PCM_FORMAT_S24_3LE;
+			app_format = EPCM_FORMAT_S24_3LE;
+			break;
+		case 16:
+			format = PCM_FORMAT_S16_LE;
+			app_format = EPCM_FORMAT_S16_LE;
+			break;
+		default:
+			KLOGE("%u bits is not supported", bits);
+			goto error;
+		}
+	}
+	wav.bits_per_sample = bits;
+	wav.byte_rate = (wav.bits_per_sample / 8) * channels * rate;
+	wav.block_align = channels * (wav.bits_per_sample / 8);
+	rec.header.fmt = wav;
+	wav_header64_set_size(&rec.header, 0);
+
+	/* whichever limit comes first */
+	if (segment_secs)
+		segment_frames = (size_t)segment_secs * rate;
+	if (segment_mb && (!segment_frames ||
+	                   ((size_t)segment_mb << 20) / wav.block_align < segment_frames))
+		segment_frames = ((size_t)segment_mb << 20) / wav.block_align;
+
+	/* Let epcm convert what the device does not give */
+	device_format = device_format_pick(card, device, PCM_IN, format);
+	if (device_format != format) {
+		if (!extended_buffer_ms) {
+			KLOGE("The device does not give %u bits%s, try -e",
+			      bits, is_float ? " float" : "");
+			goto error;
+		}
+		format = device_format;
+		KLOGD("Converting from device format %d", format);
+	} else {
+		app_format = EPCM_FORMAT_DEVICE;
+	}
 
 	memset(&config, 0, sizeof(config));
 	config.channels = channels;
@@ -153,8 +318,47 @@ int main(int argc, char *argv[])
 	memset(&econfig, 0, sizeof(econfig));
 	econfig.ram_millisecs = extended_buffer_ms;
 	econfig.tuner = 0;
+	econfig.format = app_format;
+
+	if (to_stdout) {
+		/* The sizes of a stream are unknown, readers take the data up
+		 * to its end.
+		 */
+		struct wav_header64 header = rec.header;
+		int copy = 0;
 
-	fseek(file, sizeof(struct wav_header), SEEK_SET);
+		if (segment_frames) {
+			KLOGE("No segments on stdout");
+			goto error;
+		}
+		if (fd_is_pipe(STDOUT_FILENO)) {
+			fcntl(STDOUT_FILENO, F_SETPIPE_SZ, PIPE_BYTES);
+			splice = 1;
+		}
+		signal(SIGPIPE, SIG_IGN);
+		header.riff_sz = header.data_sz = UINT32_MAX;
+		if (!raw && stream_write(STDOUT_FILENO, &header, sizeof(header), &copy) != 0) {
+			KLOGE("Unable to write stdout");
+			goto error;
+		}
+	} else {
+		/* The disk is written from its own thread, in large aligned blocks
+		 * starting at offset 0. Each segment starts with a header which that
+		 * thread keeps up to date, a crash loses a second at most.
+		 */
+		rec.path = path;
+		rec.segmented = segment_frames != 0;
+		rec.direct = direct;
+		rec.raw = raw;
+		if (rec.segmented)
+			rec.segment_bytes = segment_frames * wav.block_align + sizeof(rec.header);
+		writer = disk_writer_open(&recording_ops, &rec, WRITER_BUFFER_BYTES, writer_buffers,
+		                          (size_t)prealloc_mb << 20, rec.segmented);
+		if (!writer)
+			goto error;
+		if (!raw)
+			disk_writer_write(writer, &rec.header, sizeof(rec.header));
+	}
 
 	signal(SIGINT, sigint_handler);
 
@@ -166,33 +370,69 @@ int main(int argc, char *argv[])
 	pcm = epcm_base(epcm);
 
 	read_frames = pcm_get_buffer_size(pcm);
-	read_size = pcm_frames_to_bytes(pcm, read_frames);
-	buf = malloc(read_size);
+	read_size = read_frames * wav.block_align;
+	/* the pipe holds on to spliced buffers until its reader takes them */
+	if (splice) {
+		const int pipe_bytes = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+
+		buffers = (pipe_bytes > 0 ? pipe_bytes : PIPE_BYTES) / read_size + 2;
+	}
+	buf = malloc(buffers * read_size);
 	if (!buf) {
 		KLOGE("Failed to malloc(%d bytes)", read_size);
 		goto error;
 	}
 	total_frames = 0;
 	while (!g_quit) {
-		if (epcm_read(epcm, buf, read_size) == 0) {
-			fwrite(buf, read_size, 1, file);
-			total_frames += read_frames;
-		} else {
+		char *p = buf + buf_index * read_size;
+		size_t done = 0;
+
+		buf_index = (buf_index + 1) % buffers;
+		if (epcm_read(epcm, p, read_size) != 0) {
 			KLOGE("Error to read %u bytes", read_size);
+			continue;
 		}
-	}
+		if (to_stdout) {
+			if (stream_write(STDOUT_FILENO, p, read_size, &splice) != 0) {
+				KLOGD("stdout closed");
+				break;
+			}
+			total_frames += read_frames;
+			continue;
+		}
+		/* a segment may end anywhere in the buffer, the next one only
+		 * starts with the frames following it
+		 */
+		while (done < read_frames) {
+			size_t frames = read_frames - done;
 
-	header.data_sz = total_frames * header.block_align;
-	header.riff_sz = header.data_sz + sizeof(header) - 8;
-	fseek(file, 0, SEEK_SET);
-	fwrite(&header, sizeof(struct wav_header), 1, file);
+			if (segment_frames) {
+				if (segment_pos == segment_frames) {
+					disk_writer_split(writer);
+					if (!raw)
+						disk_writer_write(writer, &rec.header,
+						                  sizeof(rec.header));
+					segment_pos = 0;
+				}
+				if (frames > segment_frames - segment_pos)
+					frames = segment_frames - segment_pos;
+			}
+			disk_writer_write(writer, p + done * wav.block_align,
+			                  frames * wav.block_align);
+			done += frames;
+			segment_pos += frames;
+		}
+		total_frames += read_frames;
+	}
+	KLOGD("Recorded %llu frames", (unsigned long long)total_frames);
 
-	ret = EXIT_SUCCESS;
+	if (disk_writer_close(writer) == 0)
+		ret = EXIT_SUCCESS;
+	writer = NULL;
 
 error:
 	epcm_close(epcm);
+	disk_writer_close(writer);
 	free(buf);
-	if (file)
-		fclose(file);
 	return ret;
 }
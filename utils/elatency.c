@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Round-trip latency of an epcm configuration.
+ *
+ * A playback and a capture epcm run in lockstep, one read and one write
+ * of a period per loop, so the frame counters of both sides stay equal.
+ * Every cycle a test signal is written out, and the captured audio is
+ * correlated with it; the lag of the peak is the round trip in frames,
+ * from epcm_write() to epcm_read(), through the loopback in between.
+ * Without a physical cable, -V loops two virtual devices back to back.
+ */
+
+#include <easoundlib.h>
+#include <klogging.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define CHANNELS	2
+#define AMPLITUDE	16384
+#define MLS_ORDER	10
+#define WARMUP_SECS	1
+#define MAX_LATENCY_MS	500
+#define DETECT_RATIO	8.0	/* correlation peak over its rms */
+
+static int g_quit;
+
+static void sigint_handler(int sig)
+{
+	if (sig == SIGINT) {
+		g_quit = 1;
+	}
+}
+
+/* The virtual cable: what the playback device plays, the capture device
+ * records, silence while it is empty.
+ */
+struct loopback {
+	pthread_mutex_t mutex;
+	int16_t *frames;
+	size_t size;		/* in frames */
+	size_t rd;
+	size_t level;
+};
+
+static void loopback_play(void *arg, void *frames, unsigned int count)
+{
+	struct loopback *lb = (struct loopback *)arg;
+	const int16_t *p = (const int16_t *)frames;
+	unsigned int i;
+
+	pthread_mutex_lock(&lb->mutex);
+	for (i = 0; i < count && lb->level < lb->size; ++i) {
+		const size_t wr = (lb->rd + lb->level) % lb->size;
+		memcpy(lb->frames + wr * CHANNELS, p + i * CHANNELS, CHANNELS * sizeof(int16_t));
+		++lb->level;
+	}
+	pthread_mutex_unlock(&lb->mutex);
+}
+
+static void loopback_capture(void *arg, void *frames, unsigned int count)
+{
+	struct loopback *lb = (struct loopback *)arg;
+	int16_t *p = (int16_t *)frames;
+	unsigned int i;
+
+	pthread_mutex_lock(&lb->mutex);
+	for (i = 0; i < count; ++i) {
+		if (lb->level) {
+			memcpy(p + i * CHANNELS, lb->frames + lb->rd * CHANNELS,
+			       CHANNELS * sizeof(int16_t));
+			lb->rd = (lb->rd + 1) % lb->size;
+			--lb->level;
+		} else {
+			memset(p + i * CHANNELS, 0, CHANNELS * sizeof(int16_t));
+		}
+	}
+	pthread_mutex_unlock(&lb->mutex);
+}
+
+/* x^10 + x^7 + 1, 1023 chips of +/-1 */
+static size_t make_mls(float *signal)
+{
+	const size_t length = (1u << MLS_ORDER) - 1;
+	unsigned int lfsr = 1;
+	size_t i;
+
+	for (i = 0; i < length; ++i) {
+		const unsigned int bit = ((lfsr >> (MLS_ORDER - 1)) ^ (lfsr >> 6)) & 1;
+		signal[i] = (lfsr & 1) ? 1.0f : -1.0f;
+		lfsr = ((lfsr << 1) | bit) & length;
+	}
+	return length;
+}
+
+/* Lag of the correlation peak in history, or -1 when it does not stand out */
+static long detect(const float *signal, size_t length, const int16_t *history,
+                   size_t lags)
+{
+	double peak = 0.0, sum = 0.0;
+	long best = -1;
+	size_t lag, i;
+
+	for (lag = 0; lag < lags; ++lag) {
+		double c = 0.0;
+
+		for (i = 0; i < length; ++i)
+			c += signal[i] * history[lag + i];
+		sum += c * c;
+		if (fabs(c) > peak) {
+			peak = fabs(c);
+			best = lag;
+		}
+	}
+	if (peak == 0.0 || peak < DETECT_RATIO * sqrt(sum / lags))
+		return -1;
+	return best;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+	const long x = *(const long *)a, y = *(const long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = EXIT_FAILURE;
+	struct pcm_config config;
+	struct epcm_config econfig;
+	struct epcm_virtual vplay, vcap;
+	struct loopback lb;
+	struct epcm *play = NULL;
+	struct epcm *cap = NULL;
+	unsigned int card = 0;
+	unsigned int device = 0;
+	unsigned int ccard = 0;
+	unsigned int cdevice = 0;
+	unsigned int rate = 48000;
+	unsigned int period_size = 1024;
+	unsigned int period_count = 4;
+	size_t extended_buffer_ms = 0;
+	unsigned int iterations = 20;
+	int use_mls = 0;
+	int use_virtual = 0;
+	int drift_ppm = 0;
+	int tuner = 0;
+	char c = -1;
+
+	int16_t *buf = NULL;
+	int16_t *history = NULL;
+	float *test_signal = NULL;
+	long *latencies = NULL;
+	size_t length = 1;
+	size_t lags, cycle, warmup, frame = 0, emitted = 0;
+	unsigned int measured = 0, missed = 0, i;
+	double sum = 0.0, sum2 = 0.0;
+
+	KLOG_SET_OPTIONS(KLOGGING_TO_STDOUT | KLOGGING_FLUSH_IMMEDIATELY | KLOGGING_NO_SOURCEFILE);
+	KLOG_SET_LEVEL(KLOGGING_LEVEL_DEBUG);
+	KLOG_SET(argc, argv);
+
+	KCONSOLE("elatency version: %s", VERSION);
+	KCONSOLE("klogging version: %s", KVERSION());
+
+	memset(&lb, 0, sizeof(lb));
+
+	while ((c = getopt(argc, argv, "D:d:C:c:r:p:n:e:i:mV:t")) != -1) {
+		switch (c) {
+		case 'D':
+			card = atoi(optarg);
+			break;
+		case 'd':
+			device = atoi(optarg);
+			break;
+		case 'C':
+			ccard = atoi(optarg);
+			break;
+		case 'c':
+			cdevice = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 'p':
+			period_size = atoi(optarg);
+			break;
+		case 'n':
+			period_count = atoi(optarg);
+			break;
+		case 'e':
+			extended_buffer_ms = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'm':
+			use_mls = 1;
+			break;
+		case 'V':
+			use_virtual = 1;
+			drift_ppm = atoi(optarg);
+			break;
+		case 't':
+			tuner = 1;
+			break;
+		case '?':
+			KCONSOLE("Usage: elatency [-D card] [-d device] [-C capture_card] "
+			         "[-c capture_device] [-r rate] [-p period_size] [-n n_periods] "
+			         "[-e extended_buffer_ms] [-i iterations] [-m] "
+			         "[-V drift_ppm] [-t]");
+			goto error;
+		}
+	}
+	if (!rate || !period_size || !iterations) {
+		KLOGE("Invalid rate, period size or iterations");
+		goto error;
+	}
+
+	test_signal = (float *)malloc(sizeof(float) << MLS_ORDER);
+	if (!test_signal) {
+		KLOGE("Failed to alloc the test signal");
+		goto error;
+	}
+	if (use_mls) {
+		length = make_mls(test_signal);
+	} else {
+		test_signal[0] = 1.0f;
+		length = 1;
+	}
+
+	/* one signal per cycle, searched for over the cycle that follows */
+	lags = (size_t)rate * MAX_LATENCY_MS / 1000;
+	cycle = (lags + length + period_size - 1) / period_size * period_size;
+	warmup = ((size_t)rate * WARMUP_SECS + period_size - 1) / period_size * period_size;
+
+	buf = (int16_t *)malloc(period_size * CHANNELS * sizeof(int16_t));
+	history = (int16_t *)calloc(lags + length, sizeof(int16_t));
+	latencies = (long *)malloc(iterations * sizeof(long));
+	if (!buf || !history || !latencies) {
+		KLOGE("Failed to alloc buffers");
+		goto error;
+	}
+
+	memset(&config, 0, sizeof(config));
+	config.channels = CHANNELS;
+	config.rate = rate;
+	config.period_size = period_size;
+	config.period_count = period_count;
+	config.format = PCM_FORMAT_S16_LE;
+
+	memset(&econfig, 0, sizeof(econfig));
+	econfig.ram_millisecs = extended_buffer_ms;
+	econfig.tuner = tuner;
+
+	if (use_virtual) {
+		lb.size = rate;
+		lb.frames = (int16_t *)calloc(lb.size * CHANNELS, sizeof(int16_t));
+		if (!lb.frames) {
+			KLOGE("Failed to alloc the loopback");
+			goto error;
+		}
+		pthread_mutex_init(&lb.mutex, NULL);
+
+		memset(&vplay, 0, sizeof(vplay));
+		vplay.xfer = loopback_play;
+		vplay.arg = &lb;
+		memset(&vcap, 0, sizeof(vcap));
+		vcap.drift_ppm = drift_ppm;
+		vcap.xfer = loopback_capture;
+		vcap.arg = &lb;
+	}
+
+	signal(SIGINT, sigint_handler);
+
+	econfig.virtual_device = use_virtual ? &vcap : NULL;
+	cap = epcm_open(ccard, cdevice, PCM_IN, &config, &econfig);
+	econfig.virtual_device = use_virtual ? &vplay : NULL;
+	play = epcm_open(card, device, PCM_OUT, &config, &econfig);
+	if (!cap || !play) {
+		KLOGE("Unable to epcm_open()");
+		goto error;
+	}
+
+	KCONSOLE("period_size=%u period_count=%u ram=%u ms, %s, %u cycles of %u frames",
+	         period_size, period_count, (unsigned int)extended_buffer_ms,
+	         use_mls ? "MLS" : "impulse", iterations, (unsigned int)cycle);
+
+	while (!g_quit && measured + missed < iterations) {
+		size_t j;
+
+		if (epcm_read(cap, buf, period_size * CHANNELS * sizeof(int16_t)) != 0) {
+			KLOGE("Error to read");
+			goto error;
+		}
+		/* keep the first channel of the search window of the last signal */
+		if (emitted) {
+			for (j = 0; j < period_size; ++j) {
+				const size_t k = frame + j - emitted;
+				if (k < lags + length)
+					history[k] = buf[j * CHANNELS];
+			}
+			if (frame + period_size >= emitted + lags + length) {
+				const long lag = detect(test_signal, length, history, lags);
+
+				if (lag < 0) {
+					KLOGW("No signal detected");
+					++missed;
+				} else {
+					KCONSOLE("latency: %ld frames, %.3f ms",
+					         lag, lag * 1000.0 / rate);
+					latencies[measured++] = lag;
+				}
+				emitted = 0;
+			}
+		}
+
+		memset(buf, 0, period_size * CHANNELS * sizeof(int16_t));
+		if (frame >= warmup && (frame - warmup) % cycle == 0) {
+			emitted = frame;
+			memset(history, 0, (lags + length) * sizeof(int16_t));
+		}
+		/* the signal may span several periods */
+		for (j = 0; emitted && j < period_size; ++j) {
+			const size_t k = frame + j - emitted;
+			if (k < length) {
+				const int16_t v = (int16_t)(test_signal[k] * AMPLITUDE);
+				buf[j * CHANNELS] = v;
+				buf[j * CHANNELS + 1] = v;
+			}
+		}
+		if (epcm_write(play, buf, period_size * CHANNELS * sizeof(int16_t)) != 0) {
+			KLOGE("Error to write");
+			goto error;
+		}
+		frame += period_size;
+	}
+
+	if (measured) {
+		qsort(latencies, measured, sizeof(long), compare_long);
+		for (i = 0; i < measured; ++i) {
+			sum += latencies[i];
+			sum2 += (double)latencies[i] * latencies[i];
+		}
+		KCONSOLE("%u measured, %u missed", measured, missed);
+		KCONSOLE("min %.3f ms, median %.3f ms, p95 %.3f ms, max %.3f ms",
+		         latencies[0] * 1000.0 / rate,
+		         latencies[measured / 2] * 1000.0 / rate,
+		         latencies[(measured - 1) * 95 / 100] * 1000.0 / rate,
+		         latencies[measured - 1] * 1000.0 / rate);
+		KCONSOLE("mean %.3f ms, stddev %.3f ms",
+		         sum / measured * 1000.0 / rate,
+		         sqrt(sum2 / measured - (sum / measured) * (sum / measured)) * 1000.0 / rate);
+	} else {
+		KLOGE("No latency measured");
+		goto error;
+	}
+
+	ret = EXIT_SUCCESS;
+
+error:
+	epcm_close(play);
+	epcm_close(cap);
+	if (lb.frames) {
+		pthread_mutex_destroy(&lb.mutex);
+		free(lb.frames);
+	}
+	free(buf);
+	free(history);
+	free(test_signal);
+	free(latencies);
+	return ret;
+}
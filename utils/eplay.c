@@ -18,13 +18,24 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#define _GNU_SOURCE
 #include <easoundlib.h>
 #include <klogging.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "wav_header.h"
+#include "device_format.h"
+#include "pipe_io.h"
+
+/* read ahead of the next file while the current one plays */
+#define PREFETCH_MILLISECS 1000
 
 static int g_quit;
 
@@ -35,26 +46,321 @@ static void sigint_handler(int sig)
 	}
 }
 
+/* A mapped WAV file, its samples go from the page cache straight to
+ * epcm_write(). A pipe on stdin is read as it comes instead, without an
+ * image.
+ */
+struct track {
+	int fd;
+	size_t size;
+	uint8_t *image;		/* MAP_FAILED for a stream */
+	struct wav_fmt fmt;
+	const uint8_t *data;
+	size_t data_size;
+};
+
+static void track_close(struct track *t)
+{
+	if (t->image != MAP_FAILED)
+		munmap(t->image, t->size);
+	if (t->fd >= 0)
+		close(t->fd);
+	t->image = MAP_FAILED;
+	t->fd = -1;
+}
+
+/* Reads the header of a WAV stream up to the start of its data */
+static int wav_stream_parse(int fd, struct wav_fmt *fmt, size_t *data_size)
+{
+	uint32_t riff[3];
+	struct riff_chunk chunk;
+	uint8_t body[256];
+	int have_fmt = 0;
+
+	if (stream_read(fd, riff, sizeof(riff)) != sizeof(riff) ||
+	    (riff[0] != ID_RIFF && riff[0] != ID_RF64) || riff[2] != ID_WAVE)
+		return -1;
+
+	while (stream_read(fd, &chunk, sizeof(chunk)) == sizeof(chunk)) {
+		uint64_t left = (uint64_t)chunk.sz + (chunk.sz & 1);
+		int first = 1;
+
+		if (chunk.id == ID_DATA) {
+			if (!have_fmt)
+				return -1;
+			/* the size of a stream is often left open */
+			*data_size = chunk.sz && chunk.sz != UINT32_MAX ? chunk.sz : SIZE_MAX;
+			return 0;
+		}
+		while (left) {
+			const size_t n = left < sizeof(body) ? left : sizeof(body);
+
+			if (stream_read(fd, body, n) != (ssize_t)n)
+				return -1;
+			if (first && chunk.id == ID_FMT && wav_fmt_read(fmt, body, n) == 0)
+				have_fmt = 1;
+			first = 0;
+			left -= n;
+		}
+	}
+
+	return -1;
+}
+
+static int track_open_stream(struct track *t, const struct wav_fmt *raw)
+{
+	if (raw) {
+		t->fmt = *raw;
+		t->data_size = SIZE_MAX;
+	} else if (wav_stream_parse(t->fd, &t->fmt, &t->data_size) != 0) {
+		KLOGE("stdin: not a riff/wave stream");
+		return -1;
+	}
+	return 0;
+}
+
+/* "-" is stdin, mapped too when it is a file. With raw, the whole input
+ * is samples in that format.
+ */
+static int track_open(struct track *t, const char *path, const struct wav_fmt *raw)
+{
+	struct stat st;
+	size_t prefetch;
+
+	t->fd = strcmp(path, "-") ? open(path, O_RDONLY) : dup(STDIN_FILENO);
+	t->image = MAP_FAILED;
+	if (t->fd < 0 || fstat(t->fd, &st) != 0) {
+		KLOGE("Unable to open %s", path);
+		goto error;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		if (track_open_stream(t, raw) != 0)
+			goto error;
+		goto check;
+	}
+	if (st.st_size == 0) {
+		KLOGE("%s is empty", path);
+		goto error;
+	}
+	t->size = st.st_size;
+
+	t->image = (uint8_t *)mmap(NULL, t->size, PROT_READ, MAP_PRIVATE, t->fd, 0);
+	if (t->image == MAP_FAILED) {
+		KLOGE("Unable to mmap %s", path);
+		goto error;
+	}
+	madvise(t->image, t->size, MADV_SEQUENTIAL);
+	posix_fadvise(t->fd, 0, t->size, POSIX_FADV_SEQUENTIAL);
+
+	if (raw) {
+		t->fmt = *raw;
+		t->data = t->image;
+		t->data_size = t->size;
+	} else if (wav_parse(t->image, t->size, &t->fmt, &t->data, &t->data_size) != 0) {
+		KLOGE("%s: not a riff/wave file", path);
+		goto error;
+	}
+
+check:
+	if (!t->fmt.block_align || t->fmt.block_align != t->fmt.num_channels *
+	                                                  ((t->fmt.bits_per_sample + 7) / 8)) {
+		KLOGE("%s: invalid block align %u", path, t->fmt.block_align);
+		goto error;
+	}
+	/* whole frames only, the last buffer may be short */
+	t->data_size -= t->data_size % t->fmt.block_align;
+	if (t->image == MAP_FAILED)
+		return 0;
+
+	/* start reading the beginning now, it is played right after the
+	 * file before
+	 */
+	prefetch = (size_t)t->fmt.sample_rate * t->fmt.block_align * PREFETCH_MILLISECS / 1000;
+	if (prefetch > t->data_size)
+		prefetch = t->data_size;
+	posix_fadvise(t->fd, t->data - t->image, prefetch, POSIX_FADV_WILLNEED);
+
+	return 0;
+
+error:
+	track_close(t);
+	return -1;
+}
+
+static int same_format(const struct wav_fmt *a, const struct wav_fmt *b)
+{
+	return a->audio_format == b->audio_format &&
+	       a->num_channels == b->num_channels &&
+	       a->sample_rate == b->sample_rate &&
+	       a->bits_per_sample == b->bits_per_sample;
+}
+
+static int is_wav(const struct dirent *entry)
+{
+	const char *dot = strrchr(entry->d_name, '.');
+
+	return entry->d_name[0] != '.' && dot && !strcasecmp(dot, ".wav");
+}
+
+/* Adds a file, or the WAV files of a directory in name order */
+static int playlist_add(char ***list, size_t *count, const char *path)
+{
+	struct dirent **entries = NULL;
+	struct stat st;
+	char **grown;
+	int n = 1, i;
+
+	if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+		n = scandir(path, &entries, is_wav, alphasort);
+		if (n < 0) {
+			KLOGE("Unable to scan %s", path);
+			return -1;
+		}
+	}
+
+	grown = (char **)realloc(*list, (*count + n) * sizeof(char *));
+	if (!grown) {
+		KLOGE("Failed to alloc the playlist");
+		n = -1;
+		goto out;
+	}
+	*list = grown;
+	for (i = 0; i < n; ++i) {
+		char *item;
+
+		if (entries) {
+			item = (char *)malloc(strlen(path) + strlen(entries[i]->d_name) + 2);
+			if (item)
+				sprintf(item, "%s/%s", path, entries[i]->d_name);
+		} else {
+			item = strdup(path);
+		}
+		if (!item) {
+			KLOGE("Failed to alloc the playlist");
+			n = -1;
+			goto out;
+		}
+		(*list)[(*count)++] = item;
+	}
+
+out:
+	if (entries) {
+		for (i = 0; i < (n > 0 ? n : 0); ++i)
+			free(entries[i]);
+		free(entries);
+	}
+	return n < 0 ? -1 : 0;
+}
+
+static struct epcm *device_open(unsigned int card, unsigned int device,
+                                unsigned int period_size, unsigned int period_count,
+                                size_t extended_buffer_ms, const struct wav_fmt *fmt)
+{
+	struct pcm_config config;
+	struct epcm_config econfig;
+	enum pcm_format format = PCM_FORMAT_S16_LE;
+	enum pcm_format device_format;
+	enum epcm_format app_format = EPCM_FORMAT_S16_LE;
+
+	if (fmt->audio_format == FORMAT_IEEE_FLOAT && fmt->bits_per_sample == 32) {
+		format = PCM_FORMAT_INVALID;
+		app_format = EPCM_FORMAT_FLOAT_LE;
+	} else if (fmt->audio_format == FORMAT_PCM) {
+		switch (fmt->bits_per_sample) {
+		case 32:
+			format = PCM_FORMAT_S32_LE;
+			app_format = EPCM_FORMAT_S32_LE;
+			break;
+		case 24:
+			format = PCM_FORMAT_S24_3LE;
+			app_format = EPCM_FORMAT_S24_3LE;
+			break;
+		case 16:
+			format = PCM_FORMAT_S16_LE;
+			app_format = EPCM_FORMAT_S16_LE;
+			break;
+		default:
+			KLOGE("%u bits is not supported", fmt->bits_per_sample);
+			return NULL;
+		}
+	} else {
+		KLOGE("Audio format %u is not supported", fmt->audio_format);
+		return NULL;
+	}
+
+	/* Let epcm convert what the device does not take */
+	device_format = device_format_pick(card, device, PCM_OUT, format);
+	if (device_format != format) {
+		if (!extended_buffer_ms) {
+			KLOGE("The device does not take the file format, try -e");
+			return NULL;
+		}
+		format = device_format;
+		KLOGD("Converting to device format %d", format);
+	} else {
+		app_format = EPCM_FORMAT_DEVICE;
+	}
+	memset(&config, 0, sizeof(config));
+	config.channels = fmt->num_channels;
+	config.rate = fmt->sample_rate;
+	config.period_size = period_size;
+	config.period_count = period_count;
+	config.format = format;
+	config.start_threshold = 0;
+	config.stop_threshold = 0;
+	config.silence_threshold = 0;
+
+	memset(&econfig, 0, sizeof(econfig));
+	econfig.ram_millisecs = extended_buffer_ms;
+	econfig.format = app_format;
+
+	return epcm_open(card, device, PCM_OUT, &config, &econfig);
+}
+
+/* Opens the next playable file of the list */
+static int playlist_next(char **list, size_t count, size_t *index, struct track *t,
+                         const struct wav_fmt *raw)
+{
+	t->fd = -1;
+	t->image = MAP_FAILED;
+	while (*index < count) {
+		if (track_open(t, list[(*index)++], raw) == 0)
+			return 0;
+	}
+	return -1;
+}
+
 int main(int argc, char *argv[])
 {
 	int ret = EXIT_FAILURE;
-	struct pcm *pcm = NULL;
-	struct pcm_config config;
 	struct epcm *epcm = NULL;
-	struct epcm_config econfig;
-	FILE *file = NULL;
-	struct wav_header header;
+	struct track cur = { .fd = -1, .image = MAP_FAILED };
+	struct track next = { .fd = -1, .image = MAP_FAILED };
+	struct wav_fmt playing;
+	char **list = NULL;
+	size_t count = 0;
+	size_t index = 0;
 	unsigned int card = 0;
 	unsigned int device = 0;
 	unsigned int period_size = 1024;
 	unsigned int period_count = 4;
-	enum pcm_format format = PCM_FORMAT_S16_LE;
 	size_t extended_buffer_ms = 0;
 	char c = -1;
-	char *buf = NULL;
 	size_t buf_size = 0;
 	size_t buf_frames = 0;
 	size_t total_frames = 0;
+	size_t pos = 0;
+	int have_next;
+	struct wav_fmt raw;
+	int is_raw = 0;
+	int is_float = 0;
+	unsigned int bits = 16;
+	uint8_t *stream_buf = NULL;
+	size_t stream_buf_size = 0;
+
+	memset(&raw, 0, sizeof(raw));
+	raw.num_channels = 2;
+	raw.sample_rate = 48000;
 
 	KLOG_SET_OPTIONS(KLOGGING_TO_STDOUT | KLOGGING_FLUSH_IMMEDIATELY | KLOGGING_NO_SOURCEFILE);
 	KLOG_SET_LEVEL(KLOGGING_LEVEL_VERBOSE);
@@ -63,20 +369,7 @@ int main(int argc, char *argv[])
 	KCONSOLE("eplay version: %s", VERSION);
 	KCONSOLE("klogging version: %s", KVERSION());
 
-	if (argc < 2) {
-		KCONSOLE("Usage: eplay {file.wav} [-D card] [-d device] "
-		         "[-p period_size] [-n n_periods] "
-		         "[-e extended_buffer_ms]");
-		goto error;
-	}
-
-	file = fopen(argv[1], "rb");
-	if (!file) {
-		KLOGE("Unable to open %s", argv[1]);
-		goto error;
-	}
-
-	while ((c = getopt(argc, argv, "D:d:p:n:e:")) != -1) {
+	while ((c = getopt(argc, argv, "D:d:p:n:e:Rc:r:b:f")) != -1) {
 		switch (c) {
 		case 'd':
 			device = atoi(optarg);
@@ -93,86 +386,117 @@ int main(int argc, char *argv[])
 		case 'e':
 			extended_buffer_ms = atoi(optarg);
 			break;
+		case 'R':
+			is_raw = 1;
+			break;
+		case 'c':
+			raw.num_channels = atoi(optarg);
+			break;
+		case 'r':
+			raw.sample_rate = atoi(optarg);
+			break;
+		case 'b':
+			bits = atoi(optarg);
+			break;
+		case 'f':
+			is_float = 1;
+			break;
 		case '?':
 			KLOGE("Unknown option: %c", c);
 			goto error;
 		}
 	}
 
-	if (fread(&header, sizeof(header), 1, file) != 1) {
-		KLOGE("Unable to read riff/wave header");
-		goto error;
+	raw.audio_format = is_float ? FORMAT_IEEE_FLOAT : FORMAT_PCM;
+	raw.bits_per_sample = is_float ? 32 : bits;
+	raw.block_align = raw.num_channels * (raw.bits_per_sample / 8);
+	raw.byte_rate = raw.block_align * raw.sample_rate;
+
+	for (; optind < argc; ++optind) {
+		if (playlist_add(&list, &count, argv[optind]) != 0)
+			goto error;
 	}
-	if ((header.riff_id != ID_RIFF) ||
-	    (header.riff_fmt != ID_WAVE)) {
-		KLOGE("Not a riff/wave header");
+	if (!count) {
+		KCONSOLE("Usage: eplay {file.wav|directory|-}... [-D card] [-d device] "
+		         "[-p period_size] [-n n_periods] "
+		         "[-e extended_buffer_ms] [-R [-c channels] [-r rate] [-b bits] [-f]]");
 		goto error;
 	}
 
-	switch (header.bits_per_sample) {
-	case 32:
-		format = PCM_FORMAT_S32_LE;
-		break;
-	case 24:
-		format = PCM_FORMAT_S24_LE;
-		break;
-	case 16:
-		format = PCM_FORMAT_S16_LE;
-		break;
-	default:
-		KLOGE("%u bits is not supported", header.bits_per_sample);
-		goto error;
-	}
-	memset(&config, 0, sizeof(config));
-	config.channels = header.num_channels;
-	config.rate = header.sample_rate;
-	config.period_size = period_size;
-	config.period_count = period_count;
-	config.format = format;
-	config.start_threshold = 0;
-	config.stop_threshold = 0;
-	config.silence_threshold = 0;
+	signal(SIGINT, sigint_handler);
 
-	memset(&econfig, 0, sizeof(econfig));
-	econfig.ram_millisecs = extended_buffer_ms;
+	/* Files of the same format follow each other on the open device
+	 * without a drain in between. The next one is opened and read ahead
+	 * before the current one starts.
+	 */
+	have_next = playlist_next(list, count, &index, &next, is_raw ? &raw : NULL) == 0;
+	while (!g_quit && have_next) {
+		cur = next;
+		have_next = playlist_next(list, count, &index, &next, is_raw ? &raw : NULL) == 0;
 
-	fseek(file, sizeof(struct wav_header), SEEK_SET);
+		if (!epcm || !same_format(&cur.fmt, &playing)) {
+			if (epcm) {
+				KLOGD("Format changed, reopening the device");
+				epcm_drain(epcm);
+				epcm_close(epcm);
+			}
+			epcm = device_open(card, device, period_size, period_count,
+			                   extended_buffer_ms, &cur.fmt);
+			if (!epcm) {
+				KLOGE("Unable to epcm_open()");
+				goto error;
+			}
+			playing = cur.fmt;
+			buf_frames = pcm_get_buffer_size(epcm_base(epcm));
+		}
 
-	signal(SIGINT, sigint_handler);
+		for (pos = 0; !g_quit && pos < cur.data_size; pos += buf_size) {
+			const uint8_t *data = cur.data + pos;
 
-	epcm = epcm_open(card, device, PCM_OUT, &config, &econfig);
-	if (!epcm) {
-		KLOGE("Unable to epcm_open()");
-		goto error;
-	}
-	pcm = epcm_base(epcm);
+			buf_size = buf_frames * cur.fmt.block_align;
+			if (buf_size > cur.data_size - pos)
+				buf_size = cur.data_size - pos;
+			/* a pipe has to be read into memory of ours */
+			if (cur.image == MAP_FAILED) {
+				ssize_t n;
 
-	buf_frames = pcm_get_buffer_size(pcm);
-	buf_size = pcm_frames_to_bytes(pcm, buf_frames);
-	buf = malloc(buf_size);
-	if (!buf) {
-		KLOGE("Failed to malloc(%d bytes)", buf_size);
-		goto error;
-	}
-	total_frames = 0;
-	while (!g_quit) {
-		if (fread(buf, buf_size, 1, file) != 1) {
-			epcm_drain(epcm);
-			break;
-		}
-		if (epcm_write(epcm, buf, buf_size) == 0) {
-			total_frames += buf_frames;
-		} else {
-			KLOGE("Error to write %u bytes", buf_size);
+				if (stream_buf_size < buf_size) {
+					free(stream_buf);
+					stream_buf_size = 0;
+					stream_buf = (uint8_t *)malloc(buf_size);
+					if (!stream_buf) {
+						KLOGE("Failed to malloc(%u bytes)", buf_size);
+						goto error;
+					}
+					stream_buf_size = buf_size;
+				}
+				n = stream_read(cur.fd, stream_buf, buf_size);
+				buf_size = n > 0 ? n - n % cur.fmt.block_align : 0;
+				if (!buf_size)
+					break;
+				data = stream_buf;
+			}
+			if (epcm_write(epcm, data, buf_size) == 0) {
+				total_frames += buf_size / cur.fmt.block_align;
+			} else {
+				KLOGE("Error to write %u bytes", buf_size);
+			}
 		}
+		track_close(&cur);
 	}
+	if (epcm && !g_quit)
+		epcm_drain(epcm);
+	KLOGD("Played %u frames", total_frames);
 
 	ret = EXIT_SUCCESS;
 
 error:
 	epcm_close(epcm);
-	free(buf);
-	if (file)
-		fclose(file);
+	track_close(&cur);
+	track_close(&next);
+	free(stream_buf);
+	while (count)
+		free(list[--count]);
+	free(list);
 	return ret;
 }
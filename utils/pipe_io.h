@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2020 Kui Wang
+ *
+ * This file is part of etinyalsa.
+ *
+ * etinyalsa is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * etinyalsa is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with etinyalsa; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __PIPE_IO_H__
+#define __PIPE_IO_H__
+
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* stdin/stdout streaming for the utilities, vmsplice() needs _GNU_SOURCE */
+
+static inline int fd_is_pipe(int fd)
+{
+	struct stat st;
+
+	return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/* Reads until bytes are in or the stream ends, returns what was read or
+ * -1 on error.
+ */
+static inline ssize_t stream_read(int fd, void *buf, size_t bytes)
+{
+	char *p = (char *)buf;
+	size_t done = 0;
+
+	while (done < bytes) {
+		const ssize_t n = read(fd, p + done, bytes - done);
+
+		if (n == 0)
+			break;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+	return done;
+}
+
+/* Writes all of buf. With *splice set and fd a pipe, vmsplice() hands
+ * the pages to the pipe instead of copying them, so buf must not change
+ * until a pipe size of data has been written after it. *splice is
+ * cleared when the kernel refuses.
+ */
+static inline int stream_write(int fd, const void *buf, size_t bytes, int *splice)
+{
+	const char *p = (const char *)buf;
+
+	while (bytes) {
+		ssize_t n;
+
+		if (*splice) {
+			struct iovec iov = { (void *)p, bytes };
+
+			n = vmsplice(fd, &iov, 1, 0);
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS || errno == EBADF)) {
+				*splice = 0;
+				continue;
+			}
+		} else {
+			n = write(fd, p, bytes);
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		bytes -= n;
+	}
+	return 0;
+}
+
+#endif
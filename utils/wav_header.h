@@ -22,13 +22,20 @@
 #define __WAV_HEADER_H__
 
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 
 #define ID_RIFF 0x46464952
 #define ID_WAVE 0x45564157
 #define ID_FMT  0x20746d66
 #define ID_DATA 0x61746164
+#define ID_RF64 0x34364652
+#define ID_DS64 0x34367364
+#define ID_JUNK 0x4b4e554a
 
 #define FORMAT_PCM 1
+#define FORMAT_IEEE_FLOAT 3
+#define FORMAT_EXTENSIBLE 0xfffe
 
 struct wav_header {
 	uint32_t riff_id;
@@ -46,4 +53,131 @@ struct wav_header {
 	uint32_t data_sz;
 };
 
+struct riff_chunk {
+	uint32_t id;
+	uint32_t sz;
+};
+
+/* Body of the fmt chunk, extensible ones carry more after it */
+struct wav_fmt {
+	uint16_t audio_format;
+	uint16_t num_channels;
+	uint32_t sample_rate;
+	uint32_t byte_rate;
+	uint16_t block_align;
+	uint16_t bits_per_sample;
+};
+
+/* Header of files which may outgrow 4 GB. It starts as a plain RIFF with
+ * a JUNK chunk, which becomes the ds64 chunk of an RF64 (EBU 3306) once
+ * the sizes need 64 bits, so that the data never moves.
+ */
+struct wav_header64 {
+	uint32_t riff_id;
+	uint32_t riff_sz;
+	uint32_t riff_fmt;
+	uint32_t ds64_id;
+	uint32_t ds64_sz;
+	uint64_t riff_sz64;
+	uint64_t data_sz64;
+	uint64_t sample_count;
+	uint32_t table_length;
+	uint32_t fmt_id;
+	uint32_t fmt_sz;
+	struct wav_fmt fmt;
+	uint32_t data_id;
+	uint32_t data_sz;
+} __attribute__((packed));
+
+static inline void wav_header64_set_size(struct wav_header64 *h, uint64_t data_bytes)
+{
+	const uint64_t riff_bytes = data_bytes + sizeof(*h) - 8;
+
+	h->riff_fmt = ID_WAVE;
+	h->ds64_sz = 28;
+	h->table_length = 0;
+	h->fmt_id = ID_FMT;
+	h->fmt_sz = sizeof(h->fmt);
+	h->data_id = ID_DATA;
+	if (riff_bytes > UINT32_MAX) {
+		h->riff_id = ID_RF64;
+		h->riff_sz = UINT32_MAX;
+		h->ds64_id = ID_DS64;
+		h->riff_sz64 = riff_bytes;
+		h->data_sz64 = data_bytes;
+		h->sample_count = h->fmt.block_align ? data_bytes / h->fmt.block_align : 0;
+		h->data_sz = UINT32_MAX;
+	} else {
+		h->riff_id = ID_RIFF;
+		h->riff_sz = riff_bytes;
+		h->ds64_id = ID_JUNK;
+		h->riff_sz64 = h->data_sz64 = h->sample_count = 0;
+		h->data_sz = data_bytes;
+	}
+}
+
+/* Reads a fmt chunk body, extensible formats are reported by their sub
+ * format.
+ */
+static inline int wav_fmt_read(struct wav_fmt *fmt, const uint8_t *body, size_t size)
+{
+	if (size < sizeof(*fmt))
+		return -1;
+	memcpy(fmt, body, sizeof(*fmt));
+	/* cbSize, valid bits and channel mask precede the sub format */
+	if (fmt->audio_format == FORMAT_EXTENSIBLE && size >= sizeof(*fmt) + 10)
+		memcpy(&fmt->audio_format, body + sizeof(*fmt) + 8, sizeof(fmt->audio_format));
+	return 0;
+}
+
+/* Walks the chunks of a RIFF or RF64 WAVE image for fmt and data,
+ * skipping the others such as LIST or fact. A data chunk running past
+ * the image, or of size 0, as left behind by an interrupted recording,
+ * ends with the image. Returns 0, or -1 when fmt or data is missing.
+ */
+static inline int wav_parse(const uint8_t *image, size_t size, struct wav_fmt *fmt,
+                            const uint8_t **data, size_t *data_size)
+{
+	const size_t riff_bytes = 3 * sizeof(uint32_t);
+	size_t pos = riff_bytes;
+	uint32_t riff[3];
+	uint64_t data_sz64 = 0;
+	int have_fmt = 0;
+
+	if (size < riff_bytes)
+		return -1;
+	memcpy(riff, image, riff_bytes);
+	if ((riff[0] != ID_RIFF && riff[0] != ID_RF64) || riff[2] != ID_WAVE)
+		return -1;
+
+	while (size - pos >= sizeof(struct riff_chunk)) {
+		struct riff_chunk chunk;
+		size_t body;
+
+		memcpy(&chunk, image + pos, sizeof(chunk));
+		pos += sizeof(chunk);
+		body = size - pos < chunk.sz ? size - pos : chunk.sz;
+
+		if (chunk.id == ID_DS64 && body >= 2 * sizeof(uint64_t))
+			memcpy(&data_sz64, image + pos + sizeof(uint64_t), sizeof(data_sz64));
+		if (chunk.id == ID_FMT && wav_fmt_read(fmt, image + pos, body) == 0) {
+			have_fmt = 1;
+		} else if (chunk.id == ID_DATA) {
+			if (!have_fmt)
+				return -1;
+			*data = image + pos;
+			*data_size = chunk.sz ? body : size - pos;
+			if (riff[0] == ID_RF64 && chunk.sz == UINT32_MAX)
+				*data_size = size - pos < data_sz64 ? size - pos : data_sz64;
+			return 0;
+		}
+		/* chunks are word aligned */
+		if (body < chunk.sz || size - pos - body < (chunk.sz & 1))
+			break;
+		pos += body + (chunk.sz & 1);
+	}
+
+	return -1;
+}
+
 #endif